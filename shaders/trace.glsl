@@ -1,10 +1,23 @@
 #version 430 core
 
+#ifndef BVH_WIDTH
+#define BVH_WIDTH 2
+#endif
+#ifndef BVH_QUANTIZED
+#define BVH_QUANTIZED 0
+#endif
+#ifndef TRIS_IN_LEAF_ORDER
+#define TRIS_IN_LEAF_ORDER 0
+#endif
+#ifndef STACK_SIZE
+#define STACK_SIZE 64
+#endif
+
 int DEPTH = 16;
 const float EPSILON = 1e-6;
 const float MINSILON = 1e-3;
 const float MAXILON = 1e6;
-const int MAX_STACK_SIZE = 64;
+const int MAX_STACK_SIZE = STACK_SIZE;
 const float MAX_RAY_DISTANCE = 100.0;
 const int EXTRA_RAYS = 2; // times 2 + 1 per axis
 
@@ -33,6 +46,20 @@ vec3 nmax(Node node) { return node.data1.xyz; }
 uint leftOrStart(Node node) { return floatBitsToUint(node.data0.w); }
 uint count(Node node) { return floatBitsToUint(node.data1.w); }
 
+struct WideNode {
+    vec4 minX; vec4 minY; vec4 minZ;
+    vec4 maxX; vec4 maxY; vec4 maxZ;
+    ivec4 child; // first block of an inner child, triIndices start of a leaf
+    ivec4 count; // 0 = inner, > 0 = leaf triangle count, -1 = empty lane
+};
+
+struct QuantizedNode {
+    vec4 origin;   // block min corner, w = biased exponents of the per axis step
+    ivec4 child;
+    uvec4 bounds0; // lo.x, lo.y, lo.z, hi.x, one byte per lane
+    uvec4 bounds1; // hi.y, hi.z, 16 bit counts of lanes 0-1 and 2-3
+};
+
 struct Material {
     vec4 data0; // color.r, color.g, color.b, reflectivity
     vec4 data1; // translucency, emission, refractiveIndex, roughness
@@ -60,15 +87,36 @@ struct Mesh {
     int triCount;
 };
 
-struct TLAS {
-    vec3 min; float _pad0;
-    vec3 max; float _pad1;
-    int idx;
-    int type; // 0 = mesh, 1 = sphere
-    int left;
-    int right;
+struct TLAS { // children sit at left and left + 1
+    vec4 data0; // min.x, min.y, min.z, left for inner entries, idx for leaves
+    vec4 data1; // max.x, max.y, max.z, type: -1 = inner, 0 = instance, 1 = sphere, 2 = sphere BVH root
+};
+
+vec3 tmin(TLAS entry) { return entry.data0.xyz; }
+vec3 tmax(TLAS entry) { return entry.data1.xyz; }
+int leftOrIdx(TLAS entry) { return floatBitsToInt(entry.data0.w); }
+int entryType(TLAS entry) { return floatBitsToInt(entry.data1.w); }
+
+struct Instance {
+    vec4 toWorld[3];  // rows of the 3x4 object to world transform
+    vec4 toObject[3]; // rows of its inverse
+    int meshIdx;
+    int _pad0; int _pad1; int _pad2;
 };
 
+// The direction is not normalized, so t along it is the world space distance.
+vec3 toObjectPoint(Instance inst, vec3 p) {
+    vec4 p4 = vec4(p, 1.0);
+    return vec3(dot(inst.toObject[0], p4), dot(inst.toObject[1], p4), dot(inst.toObject[2], p4));
+}
+vec3 toObjectDir(Instance inst, vec3 d) {
+    return vec3(dot(inst.toObject[0].xyz, d), dot(inst.toObject[1].xyz, d), dot(inst.toObject[2].xyz, d));
+}
+// normals transform with the inverse transpose
+vec3 toWorldNormal(Instance inst, vec3 n) {
+    return normalize(n.x * inst.toObject[0].xyz + n.y * inst.toObject[1].xyz + n.z * inst.toObject[2].xyz);
+}
+
 layout (local_size_x = 8, local_size_y = 8) in;
 
 layout (rgba32f, binding = 0) uniform image2D imgOutput;
@@ -96,12 +144,29 @@ layout (std430, binding = 2) buffer BVH { Node nodes[]; };
 
 layout (std430, binding = 3) buffer Materials { Material materials[]; };
 
+#if TRIS_IN_LEAF_ORDER
+int triRef(int i) { return i; }
+#else
 layout (std430, binding = 4) buffer TriIndices { int triIndices[]; };
+int triRef(int i) { return triIndices[i]; }
+#endif
 
 layout (std430, binding = 5) buffer Meshes { Mesh meshes[]; };
 
 layout (std430, binding = 6) buffer TLASBuffer { TLAS tlas[]; };
 
+#if BVH_WIDTH > 2 && BVH_QUANTIZED
+layout (std430, binding = 7) buffer WideBVH { QuantizedNode quantizedNodes[]; };
+#elif BVH_WIDTH > 2
+layout (std430, binding = 7) buffer WideBVH { WideNode wideNodes[]; };
+#endif
+
+layout (std430, binding = 8) buffer Instances { Instance instances[]; };
+
+layout (std430, binding = 9) buffer SphereBVH { Node sphereNodes[]; };
+
+layout (std430, binding = 10) buffer SphereIndices { int sphereIndices[]; };
+
 float findTriangleIntersection(vec3 rayOrigin, vec3 rayDir, int i) {
     vec3 h = cross(rayDir, e2(triangles[i]));
     float a = dot(e1(triangles[i]), h);
@@ -147,6 +212,147 @@ float intersectAABB(vec3 rayOri, vec3 invDir, vec3 minBound, vec3 maxBound) {
     return hit ? tclose : MAXILON;
 }
 
+#if BVH_WIDTH > 2
+const int WIDE_BLOCKS = BVH_WIDTH / 4;
+
+#if BVH_QUANTIZED
+// Steps are powers of two, so the decoded bounds match the conservative CPU encoding.
+WideNode loadWideNode(uint idx) {
+    QuantizedNode q = quantizedNodes[idx];
+    uint exponents = floatBitsToUint(q.origin.w);
+    vec3 step = vec3(uintBitsToFloat((exponents & 0xffu) << 23),
+                     uintBitsToFloat(((exponents >> 8) & 0xffu) << 23),
+                     uintBitsToFloat(((exponents >> 16) & 0xffu) << 23));
+    uvec4 shifts = uvec4(0u, 8u, 16u, 24u);
+
+    WideNode wide;
+    wide.minX = q.origin.x + vec4((uvec4(q.bounds0.x) >> shifts) & 0xffu) * step.x;
+    wide.minY = q.origin.y + vec4((uvec4(q.bounds0.y) >> shifts) & 0xffu) * step.y;
+    wide.minZ = q.origin.z + vec4((uvec4(q.bounds0.z) >> shifts) & 0xffu) * step.z;
+    wide.maxX = q.origin.x + vec4((uvec4(q.bounds0.w) >> shifts) & 0xffu) * step.x;
+    wide.maxY = q.origin.y + vec4((uvec4(q.bounds1.x) >> shifts) & 0xffu) * step.y;
+    wide.maxZ = q.origin.z + vec4((uvec4(q.bounds1.y) >> shifts) & 0xffu) * step.z;
+    uvec4 counts = (uvec4(q.bounds1.zz, q.bounds1.ww) >> uvec4(0u, 16u, 0u, 16u)) & 0xffffu;
+    wide.count = ivec4(counts) - ivec4(equal(counts, uvec4(0xffffu))) * 0x10000; // 0xffff -> -1
+    wide.child = q.child;
+    return wide;
+}
+#else
+WideNode loadWideNode(uint idx) { return wideNodes[idx]; }
+#endif
+
+// Slab test of all four lanes of a wide node block at once, MAXILON for misses.
+vec4 intersectLanes(vec3 rayOri, vec3 invDir, WideNode wide) {
+    vec4 tx0 = (wide.minX - rayOri.x) * invDir.x;
+    vec4 tx1 = (wide.maxX - rayOri.x) * invDir.x;
+    vec4 ty0 = (wide.minY - rayOri.y) * invDir.y;
+    vec4 ty1 = (wide.maxY - rayOri.y) * invDir.y;
+    vec4 tz0 = (wide.minZ - rayOri.z) * invDir.z;
+    vec4 tz1 = (wide.maxZ - rayOri.z) * invDir.z;
+    vec4 tclose = max(max(min(tx0, tx1), min(ty0, ty1)), min(tz0, tz1));
+    vec4 tfar = min(min(max(tx0, tx1), max(ty0, ty1)), max(tz0, tz1));
+    bvec4 hit = bvec4(step(tclose, tfar) * step(vec4(0.0), tfar));
+    return mix(vec4(MAXILON), tclose, hit);
+}
+
+Hit traverseBVH(vec3 rayOri, vec3 rayDir, vec3 invRayDir, int meshIdx, float currentClosestT) {
+    float closestT = currentClosestT;
+    int closestTri = -1;
+
+    uint istack[MAX_STACK_SIZE];
+    float tstack[MAX_STACK_SIZE];
+    int sp = 0;
+    istack[sp] = meshes[meshIdx].bvhRoot;
+    tstack[sp] = 0;
+    sp++;
+
+    while (sp-- > 0) {
+        if (tstack[sp] >= closestT) continue;
+        uint idx = istack[sp];
+
+        uint childIdx[BVH_WIDTH];
+        float childT[BVH_WIDTH];
+        int hits = 0;
+        for (int b = 0; b < WIDE_BLOCKS; b++) {
+            WideNode wide = loadWideNode(idx + uint(b));
+            vec4 tLanes = intersectLanes(rayOri, invRayDir, wide);
+            for (int l = 0; l < 4; l++) {
+                int count = wide.count[l];
+                if (count < 0 || tLanes[l] >= closestT) continue;
+                if (count > 0) {
+                    int start = wide.child[l];
+                    for (int i = start; i < start + count; i++) {
+                        int triIndex = triRef(i);
+                        float t = findTriangleIntersection(rayOri, rayDir, triIndex);
+                        if (t > 0.0 && t < closestT) {
+                            closestT = t;
+                            closestTri = triIndex;
+                        }
+                    }
+                } else {
+                    childIdx[hits] = uint(wide.child[l]);
+                    childT[hits] = tLanes[l];
+                    hits++;
+                }
+            }
+        }
+
+        // push far to near so the nearest child is popped first
+        for (int i = 1; i < hits; i++) {
+            for (int j = i; j > 0 && childT[j] > childT[j - 1]; j--) {
+                float t = childT[j]; childT[j] = childT[j - 1]; childT[j - 1] = t;
+                uint c = childIdx[j]; childIdx[j] = childIdx[j - 1]; childIdx[j - 1] = c;
+            }
+        }
+        for (int i = 0; i < hits && sp < MAX_STACK_SIZE; i++) {
+            istack[sp] = childIdx[i];
+            tstack[sp] = childT[i];
+            sp++;
+        }
+    }
+
+    if (closestTri == -1 || closestT == MAXILON) {
+        Hit noHit;
+        noHit.t = MAXILON;
+        return noHit;
+    }
+
+    Hit hit;
+    hit.t = closestT;
+    hit.Q = rayOri + hit.t * rayDir;
+    hit.N = n(triangles[closestTri]);
+    return hit;
+}
+
+bool traverseBVHAny(vec3 rayOri, vec3 rayDir, vec3 invRayDir, int meshIdx, float maxT) {
+    uint istack[MAX_STACK_SIZE];
+    int sp = 0;
+    istack[sp++] = meshes[meshIdx].bvhRoot;
+
+    while (sp-- > 0) {
+        uint idx = istack[sp];
+        for (int b = 0; b < WIDE_BLOCKS; b++) {
+            WideNode wide = loadWideNode(idx + uint(b));
+            vec4 tLanes = intersectLanes(rayOri, invRayDir, wide);
+            for (int l = 0; l < 4; l++) {
+                int count = wide.count[l];
+                if (count < 0 || tLanes[l] >= maxT) continue;
+                if (count > 0) {
+                    int start = wide.child[l];
+                    for (int i = start; i < start + count; i++) {
+                        float t = findTriangleIntersection(rayOri, rayDir, triRef(i));
+                        if (t > 0.0 && t < maxT) return true;
+                    }
+                } else if (sp < MAX_STACK_SIZE) {
+                    istack[sp++] = uint(wide.child[l]);
+                }
+            }
+        }
+    }
+    return false;
+}
+#else
+
 Hit traverseBVH(vec3 rayOri, vec3 rayDir, vec3 invRayDir, int meshIdx, float currentClosestT) {
     float closestT = currentClosestT;
     uint closestN = 0xFFFFFFFF;
@@ -170,7 +376,7 @@ Hit traverseBVH(vec3 rayOri, vec3 rayDir, vec3 invRayDir, int meshIdx, float cur
         if (count > 0) {
             uint start = leftOrStart(nodes[child]);
             for (uint i = start; i < start + count; i++) {
-                int triIndex = triIndices[i];
+                int triIndex = triRef(i);
                 float t = findTriangleIntersection(rayOri, rayDir, triIndex);
                 if (t > 0.0 && t < closestT) {
                     closestT = t;
@@ -246,7 +452,7 @@ bool traverseBVHAny(vec3 rayOri, vec3 rayDir, vec3 invRayDir, int meshIdx, float
         if (count > 0) {
             uint start = leftOrStart(nodes[child]);
             for (uint i = start; i < start + count; i++) {
-                int triIndex = triIndices[i];
+                int triIndex = triRef(i);
                 float t = findTriangleIntersection(rayOri, rayDir, triIndex);
                 if (t > 0.0 && t < closestT) return true;
             }
@@ -285,30 +491,72 @@ bool traverseBVHAny(vec3 rayOri, vec3 rayDir, vec3 invRayDir, int meshIdx, float
     }
     return false;
 }
+#endif
 
-Hit intersectSpheres(vec3 rayOri, vec3 rayDir) {
-    float closestT = MAXILON;
-    int closestIdx = -1;
-    for (int i = 0; i < spheres.length(); i++) {
-        float t = findSphereIntersection(rayOri, rayDir, i);
-        if (t < closestT) {
-            closestT = t;
-            closestIdx = i;
-        }
-    }
-    if (closestIdx == -1 || closestT == MAXILON) {
-        Hit noHit;
-        noHit.t = MAXILON;
-        return noHit;
-    }
+Hit sphereHit(vec3 rayOri, vec3 rayDir, float t, int i) {
     Hit hit;
-    hit.t = closestT;
+    hit.t = t;
     hit.mat = materials[1];
     hit.Q = rayOri + hit.t * rayDir;
-    hit.N = normalize(hit.Q - center(spheres[closestIdx]));
+    hit.N = normalize(hit.Q - center(spheres[i]));
     return hit;
 }
 
+// Closest sphere below root in the sphere BVH nearer than closestT, which it
+// lowers to the hit, or -1. With anyHit the first sphere found is returned.
+int traverseSphereBVH(vec3 rayOri, vec3 rayDir, vec3 invRayDir, uint root, inout float closestT, bool anyHit) {
+    int closestSph = -1;
+
+    uint istack[MAX_STACK_SIZE];
+    float tstack[MAX_STACK_SIZE];
+    int sp = 0;
+    istack[sp] = root;
+    tstack[sp] = 0;
+    sp++;
+
+    while (sp-- > 0) {
+        if (tstack[sp] >= closestT) continue;
+        Node node = sphereNodes[istack[sp]];
+
+        uint count = count(node);
+        if (count > 0) {
+            uint start = leftOrStart(node);
+            for (uint i = start; i < start + count; i++) {
+                int sphIndex = sphereIndices[i];
+                float t = findSphereIntersection(rayOri, rayDir, sphIndex);
+                if (t < closestT) {
+                    closestT = t;
+                    closestSph = sphIndex;
+                    if (anyHit) return closestSph;
+                }
+            }
+            continue;
+        }
+
+        uint left = leftOrStart(node);
+        uint right = left + 1u;
+        float tL = intersectAABB(rayOri, invRayDir, nmin(sphereNodes[left]), nmax(sphereNodes[left]));
+        float tR = intersectAABB(rayOri, invRayDir, nmin(sphereNodes[right]), nmax(sphereNodes[right]));
+
+        // push the farther child first so the nearer one is popped next
+        if (tL < tR) {
+            float ft = tL; tL = tR; tR = ft;
+            uint fi = left; left = right; right = fi;
+        }
+        if (tL < closestT && sp < MAX_STACK_SIZE) {
+            istack[sp] = left;
+            tstack[sp] = tL;
+            sp++;
+        }
+        if (tR < closestT && sp < MAX_STACK_SIZE) {
+            istack[sp] = right;
+            tstack[sp] = tR;
+            sp++;
+        }
+    }
+    return closestSph;
+}
+
 Hit getHit(vec3 rayOri, vec3 rayDir) {
     vec3 invRayDir = 1.0 / rayDir;
     float closestT = MAXILON;
@@ -326,31 +574,39 @@ Hit getHit(vec3 rayOri, vec3 rayDir) {
         float t = tstack[sp];
         if (t >= closestT) continue;
         
-        uint child = istack[sp];
+        TLAS entry = tlas[istack[sp]];
+        int type = entryType(entry);
 
-        if (tlas[child].type == 0) {
-            Hit hit = traverseBVH(rayOri, rayDir, invRayDir, tlas[child].idx, closestT);
+        if (type == 0) {
+            Instance inst = instances[leftOrIdx(entry)];
+            vec3 objDir = toObjectDir(inst, rayDir);
+            Hit hit = traverseBVH(toObjectPoint(inst, rayOri), objDir, 1.0 / objDir, inst.meshIdx, closestT);
             if (hit.t < closestT) {
                 closestT = hit.t;
                 finalHit = hit;
-                finalHit.mat = materials[meshes[tlas[child].idx].matIdx];
+                finalHit.Q = rayOri + hit.t * rayDir;
+                finalHit.N = toWorldNormal(inst, hit.N);
+                finalHit.mat = materials[meshes[inst.meshIdx].matIdx];
             }
-        } else if (tlas[child].type == 1) {
-            Hit hit = intersectSpheres(rayOri, rayDir);
-            if (hit.t < closestT) {
-                closestT = hit.t;
-                finalHit = hit;
-                finalHit.mat = materials[1];
+        } else if (type == 1) {
+            int sphIndex = leftOrIdx(entry);
+            float t = findSphereIntersection(rayOri, rayDir, sphIndex);
+            if (t < closestT) {
+                closestT = t;
+                finalHit = sphereHit(rayOri, rayDir, t, sphIndex);
             }
+        } else if (type == 2) {
+            int sphIndex = traverseSphereBVH(rayOri, rayDir, invRayDir, uint(leftOrIdx(entry)), closestT, false);
+            if (sphIndex >= 0) finalHit = sphereHit(rayOri, rayDir, closestT, sphIndex);
         } else {
-            uint left = uint(tlas[child].left);
-            uint right = uint(tlas[child].right);
+            uint left = uint(leftOrIdx(entry));
+            uint right = left + 1u;
 
             TLAS ln = tlas[left];
             TLAS rn = tlas[right];
 
-            float tL = intersectAABB(rayOri, invRayDir, ln.min, ln.max);
-            float tR = intersectAABB(rayOri, invRayDir, rn.min, rn.max);
+            float tL = intersectAABB(rayOri, invRayDir, tmin(ln), tmax(ln));
+            float tR = intersectAABB(rayOri, invRayDir, tmin(rn), tmax(rn));
 
             if (tL < tR) {
                 if (tR <= closestT && tR != MAXILON && sp < MAX_STACK_SIZE) { 
@@ -395,26 +651,33 @@ bool getHitAny(vec3 rayOri, vec3 rayDir, float maxT) {
         float t = tstack[sp];
         if (t >= maxT) continue;
         
-        uint child = istack[sp];
+        TLAS entry = tlas[istack[sp]];
+        int type = entryType(entry);
 
-        if (tlas[child].type == 0) {
-            if (traverseBVHAny(rayOri, rayDir, invRayDir, tlas[child].idx, maxT)) {
+        if (type == 0) {
+            Instance inst = instances[leftOrIdx(entry)];
+            vec3 objDir = toObjectDir(inst, rayDir);
+            if (traverseBVHAny(toObjectPoint(inst, rayOri), objDir, 1.0 / objDir, inst.meshIdx, maxT)) {
+                return true;
+            }
+        } else if (type == 1) {
+            if (findSphereIntersection(rayOri, rayDir, leftOrIdx(entry)) < maxT) {
                 return true;
             }
-        } else if (tlas[child].type == 1) {
-            Hit hit = intersectSpheres(rayOri, rayDir);
-            if (hit.t < maxT) {
+        } else if (type == 2) {
+            float t = maxT;
+            if (traverseSphereBVH(rayOri, rayDir, invRayDir, uint(leftOrIdx(entry)), t, true) >= 0) {
                 return true;
             }
         } else {
-            uint left = uint(tlas[child].left);
-            uint right = uint(tlas[child].right);
+            uint left = uint(leftOrIdx(entry));
+            uint right = left + 1u;
 
             TLAS ln = tlas[left];
             TLAS rn = tlas[right];
 
-            float tL = intersectAABB(rayOri, invRayDir, ln.min, ln.max);
-            float tR = intersectAABB(rayOri, invRayDir, rn.min, rn.max);
+            float tL = intersectAABB(rayOri, invRayDir, tmin(ln), tmax(ln));
+            float tR = intersectAABB(rayOri, invRayDir, tmin(rn), tmax(rn));
 
             if (tL < tR) {
                 if (tR <= maxT && tR != MAXILON && sp < MAX_STACK_SIZE) { 
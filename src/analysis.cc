@@ -0,0 +1,558 @@
+#include <glm/glm.hpp>
+#include <structs.hh>
+#include <bvh.hh>
+#include <analysis.hh>
+#include <trace.hh>
+#include <utilities.hh>
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+struct MeshStats {
+    int nodeCount = 0;
+    int leafCount = 0;
+    int references = 0;
+    int maxDepth = 0;
+    float sah = 0.0f;
+    float epo = 0.0f;
+    float emptySpace = 0.0f;
+    std::vector<int> leafSizes;  // leaves per triangle count
+    std::vector<int> leafDepths; // leaves per depth
+};
+
+struct FlatNode {
+    int node;
+    int depth;
+    int last; // pre-order position of the last node in this subtree
+};
+
+const char* builderName(BVHBuilder builder) {
+    switch (builder) {
+        case BVHBuilder::Sweep: return "sweep";
+        case BVHBuilder::Binned: return "binned";
+        case BVHBuilder::LBVH: return "lbvh";
+        case BVHBuilder::PLOC: return "ploc";
+        case BVHBuilder::SBVH: return "sbvh";
+    }
+    return "unknown";
+}
+
+const char* layoutName(BVHLayout layout) {
+    switch (layout) {
+        case BVHLayout::Build: return "build";
+        case BVHLayout::DepthFirst: return "dfs";
+        case BVHLayout::VanEmdeBoas: return "veb";
+        case BVHLayout::Treelet: return "treelet";
+    }
+    return "unknown";
+}
+
+static float volume(const vec3& minv, const vec3& maxv) {
+    vec3 d = max(maxv - minv, vec3(0.0f));
+    return d.x * d.y * d.z;
+}
+
+static float triangleArea(const Tri& tri) {
+    return 0.5f * length(cross(tri.v1 - tri.v0, tri.v2 - tri.v0));
+}
+
+static bool overlaps(const Tri& tri, const Node& node) {
+    return tri.min.x <= node.max.x && tri.max.x >= node.min.x &&
+           tri.min.y <= node.max.y && tri.max.y >= node.min.y &&
+           tri.min.z <= node.max.z && tri.max.z >= node.min.z;
+}
+
+static int flatten(int idx, int depth, std::vector<FlatNode>& flat) {
+    int pos = (int)flat.size();
+    flat.push_back({ idx, depth, pos });
+    const Node& node = nodes[idx];
+    int last = pos;
+    if (node.count == 0) {
+        flatten(node.start, depth + 1, flat);
+        last = flatten(node.start + 1, depth + 1, flat);
+    }
+    flat[pos].last = last;
+    return last;
+}
+
+static MeshStats analyzeMesh(const Mesh& mesh) {
+    MeshStats stats;
+    stats.sah = computeSAH(mesh);
+
+    std::vector<FlatNode> flat;
+    flatten(mesh.bvhRoot, 0, flat);
+    stats.nodeCount = (int)flat.size();
+
+    // leaves referencing each triangle, by pre-order position (several with spatial splits)
+    std::vector<std::vector<int>> leavesOf(mesh.triCount);
+    float innerVolume = 0.0f;
+    float coveredVolume = 0.0f;
+    for (int pos = 0; pos < (int)flat.size(); pos++) {
+        const Node& node = nodes[flat[pos].node];
+        if (node.count > 0) {
+            stats.leafCount++;
+            stats.references += node.count;
+            stats.maxDepth = std::max(stats.maxDepth, flat[pos].depth);
+            if ((int)stats.leafSizes.size() <= node.count) stats.leafSizes.resize(node.count + 1, 0);
+            if ((int)stats.leafDepths.size() <= flat[pos].depth) stats.leafDepths.resize(flat[pos].depth + 1, 0);
+            stats.leafSizes[node.count]++;
+            stats.leafDepths[flat[pos].depth]++;
+            for (int i = node.start; i < node.start + node.count; i++) {
+                leavesOf[triIndices[i] - mesh.triStart].push_back(pos);
+            }
+        } else {
+            const Node& l = nodes[node.start];
+            const Node& r = nodes[node.start + 1];
+            float overlap = volume(max(l.min, r.min), min(l.max, r.max));
+            innerVolume += volume(node.min, node.max);
+            coveredVolume += volume(l.min, l.max) + volume(r.min, r.max) - overlap;
+        }
+    }
+    if (innerVolume > 0.0f) stats.emptySpace = std::max(0.0f, 1.0f - coveredVolume / innerVolume);
+
+    std::unordered_map<int, int> posOf;
+    for (int pos = 0; pos < (int)flat.size(); pos++) posOf[flat[pos].node] = pos;
+
+    float totalArea = 0.0f;
+    float overlapArea = 0.0f;
+    std::vector<int> stack;
+    for (int t = 0; t < mesh.triCount; t++) {
+        const Tri& tri = triangles[mesh.triStart + t];
+        totalArea += triangleArea(tri);
+        stack.assign(1, mesh.bvhRoot);
+        while (!stack.empty()) {
+            int idx = stack.back();
+            stack.pop_back();
+            const Node& node = nodes[idx];
+            if (!overlaps(tri, node)) continue;
+
+            int pos = posOf[idx];
+            bool inside = false;
+            for (int leaf : leavesOf[t]) inside |= leaf >= pos && leaf <= flat[pos].last;
+            if (!inside) overlapArea += clippedTriangleArea(tri, node.min, node.max);
+
+            if (node.count == 0) {
+                stack.push_back(node.start);
+                stack.push_back(node.start + 1);
+            }
+        }
+    }
+    if (totalArea > 0.0f) stats.epo = overlapArea / totalArea;
+    return stats;
+}
+
+static void writeHistogram(std::ostream& out, const std::vector<int>& histogram) {
+    out << "[";
+    for (size_t i = 0; i < histogram.size(); i++) out << (i ? ", " : "") << histogram[i];
+    out << "]";
+}
+
+// The TLAS with everything it points to besides the mesh BVHs.
+static size_t tlasMemory() {
+    return tlas.size() * sizeof(GPUTLAS) + instances.size() * sizeof(Instance) +
+           sphereNodes.size() * sizeof(GPUNode) + sphereIndices.size() * sizeof(int);
+}
+
+static void writeTLAS(std::ostream& out) {
+    int maxDepth = 0;
+    float cost = 0.0f;
+    if (!tlas.empty()) {
+        float rootArea = area(vec3(tlas[0].min), vec3(tlas[0].max));
+        std::vector<std::pair<int, int>> stack = { { 0, 0 } };
+        while (!stack.empty()) {
+            std::pair<int, int> top = stack.back();
+            stack.pop_back();
+            const TLAS& entry = tlas[top.first];
+            cost += area(vec3(entry.min), vec3(entry.max));
+            maxDepth = std::max(maxDepth, top.second);
+            if (entry.idx == -1) {
+                stack.push_back({ entry.left, top.second + 1 });
+                stack.push_back({ entry.right, top.second + 1 });
+            }
+        }
+        if (rootArea > 0.0f) cost /= rootArea;
+    }
+    out << "  \"tlas\": {\n"
+        << "    \"nodes\": " << tlas.size() << ",\n"
+        << "    \"instances\": " << instances.size() << ",\n"
+        << "    \"sphereNodes\": " << sphereNodes.size() << ",\n"
+        << "    \"maxDepth\": " << maxDepth << ",\n"
+        << "    \"sah\": " << cost << ",\n"
+        << "    \"memoryBytes\": " << tlasMemory() << "\n"
+        << "  },\n";
+}
+
+void writeBVHAnalysis(std::ostream& out) {
+    int totalNodes = 0;
+    float totalSAH = 0.0f;
+    size_t totalMemory = 0;
+
+    out << "{\n"
+        << "  \"builder\": \"" << builderName(bvhSettings.builder) << "\",\n"
+        << "  \"meshes\": [\n";
+    for (size_t m = 0; m < meshes.size(); m++) {
+        const Mesh& mesh = meshes[m];
+        MeshStats stats = analyzeMesh(mesh);
+        size_t memory = stats.nodeCount * sizeof(GPUNode) + stats.references * sizeof(int);
+        totalNodes += stats.nodeCount;
+        totalSAH += stats.sah;
+        totalMemory += memory;
+
+        out << "    {\n"
+            << "      \"mesh\": " << m << ",\n"
+            << "      \"triangles\": " << mesh.triCount << ",\n"
+            << "      \"references\": " << stats.references << ",\n"
+            << "      \"nodes\": " << stats.nodeCount << ",\n"
+            << "      \"leaves\": " << stats.leafCount << ",\n"
+            << "      \"maxDepth\": " << stats.maxDepth << ",\n"
+            << "      \"sah\": " << stats.sah << ",\n"
+            << "      \"epo\": " << stats.epo << ",\n"
+            << "      \"emptySpaceRatio\": " << stats.emptySpace << ",\n"
+            << "      \"memoryBytes\": " << memory << ",\n"
+            << "      \"leafSizeHistogram\": ";
+        writeHistogram(out, stats.leafSizes);
+        out << ",\n      \"leafDepthHistogram\": ";
+        writeHistogram(out, stats.leafDepths);
+        out << "\n    }" << (m + 1 < meshes.size() ? "," : "") << "\n";
+    }
+    out << "  ],\n";
+    writeTLAS(out);
+    out << "  \"total\": {\n"
+        << "    \"nodes\": " << totalNodes << ",\n"
+        << "    \"sah\": " << totalSAH << ",\n"
+        << "    \"memoryBytes\": " << totalMemory + tlasMemory() << "\n"
+        << "  }\n"
+        << "}\n";
+}
+
+// Primary rays of the default camera (same setup as trace.glsl) followed by as
+// many incoherent rays between random points of the scene bounds, standing in
+// for secondary bounces.
+static std::vector<Ray> benchmarkRays() {
+    const Camera cam = defaultCamera(Config::width, Config::height);
+    const vec3 position = cam.position;
+    const vec3 forward = cam.forward;
+    const vec3 up = cam.up;
+    const vec3 right = normalize(cross(forward, up));
+    const float scale = tan(cam.fov / 2.0f);
+    const float aspect = cam.aspect;
+
+    std::vector<Ray> rays;
+    for (int y = 0; y < Config::height; y++) {
+        for (int x = 0; x < Config::width; x++) {
+            vec2 uv = (vec2(x, y) + vec2(0.5f)) / vec2(Config::width, Config::height) * 2.0f - 1.0f;
+            uv.x *= aspect;
+            rays.push_back(makeRay(position, normalize(forward + uv.x * scale * right + uv.y * scale * up)));
+        }
+    }
+
+    vec3 sceneMin, sceneMax;
+    sceneBounds(sceneMin, sceneMax);
+    srand(7);
+    auto randomPoint = [&]() {
+        return vec3(rnd(sceneMin.x, sceneMax.x), rnd(sceneMin.y, sceneMax.y), rnd(sceneMin.z, sceneMax.z));
+    };
+    for (int i = 0; i < Config::width * Config::height; i++) {
+        vec3 origin = randomPoint();
+        vec3 dir = randomPoint() - origin;
+        if (dot(dir, dir) > 0.0f) rays.push_back(makeRay(origin, normalize(dir)));
+    }
+    return rays;
+}
+
+static const int benchCacheBytes = 8192;
+static const int benchLineBytes = 64;
+static const int benchWays = 8;
+
+// Traces the primary and then the random rays through trees, each set with a
+// cold cache, and writes their node visits and simulated misses.
+static void writeTraceSets(std::ostream& out, const TraceTrees& trees, const std::vector<Ray>& rays) {
+    const int primaryRays = Config::width * Config::height;
+    for (int set = 0; set < 2; set++) {
+        CacheSim cache(benchCacheBytes, benchLineBytes, benchWays);
+        TraceStats stats;
+        stats.cache = &cache;
+        int begin = set == 0 ? 0 : primaryRays;
+        int end = set == 0 ? primaryRays : (int)rays.size();
+        for (int r = begin; r < end; r++) traceInstances(trees, rays[r], FLT_MAX, &stats);
+        out << ", \"" << (set == 0 ? "primary" : "random") << "\": { "
+            << "\"nodeVisits\": " << stats.nodeVisits
+            << ", \"boxTests\": " << stats.boxTests
+            << ", \"lineFetches\": " << cache.accesses
+            << ", \"misses\": " << cache.misses
+            << ", \"missRate\": " << (cache.accesses ? (double)cache.misses / cache.accesses : 0.0) << " }";
+    }
+}
+
+void writeLayoutBenchmark(std::ostream& out) {
+    const int primaryRays = Config::width * Config::height;
+    std::vector<Ray> rays = benchmarkRays();
+
+    const BVHLayout layouts[] = { BVHLayout::Build, BVHLayout::DepthFirst, BVHLayout::VanEmdeBoas, BVHLayout::Treelet };
+    out << "{\n"
+        << "  \"rays\": { \"primary\": " << primaryRays << ", \"random\": " << rays.size() - primaryRays << " },\n"
+        << "  \"cache\": { \"sizeBytes\": " << benchCacheBytes << ", \"lineBytes\": " << benchLineBytes
+        << ", \"ways\": " << benchWays << " },\n"
+        << "  \"width\": " << traceWidth() << ",\n"
+        << "  \"compressed\": " << (bvhSettings.compress ? "true" : "false") << ",\n"
+        << "  \"layouts\": [\n";
+    for (int l = 0; l < 4; l++) {
+        for (Mesh& mesh : meshes) layoutBVH(mesh, layouts[l]);
+
+        out << "    { \"layout\": \"" << layoutName(layouts[l]) << "\"";
+        writeTraceSets(out, collapseTraceTrees(traceWidth(), bvhSettings.compress), rays);
+        out << " }" << (l + 1 < 4 ? "," : "") << "\n";
+    }
+
+    // the same rays through the last layout collapsed to every width, and
+    // quantized for the wide ones
+    const int widths[] = { 2, 4, 8, 4, 8 };
+    const bool compressed[] = { false, false, false, true, true };
+    out << "  ],\n"
+        << "  \"widths\": [\n";
+    for (int w = 0; w < 5; w++) {
+        out << "    { \"width\": " << widths[w] << ", \"compressed\": " << (compressed[w] ? "true" : "false");
+        writeTraceSets(out, collapseTraceTrees(widths[w], compressed[w]), rays);
+        out << " }" << (w + 1 < 5 ? "," : "") << "\n";
+    }
+    out << "  ]\n"
+        << "}\n";
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static volatile float calibrationSink; // keeps the timed loops from being optimized away
+
+// Seconds per node visit (the two child box tests of an inner node) and per
+// triangle test, timed over a working set of the scene's own nodes and
+// triangles that stays in cache, like the top of a traversal does.
+static void measureOperations(const std::vector<Ray>& rays, double& visitSeconds, double& triSeconds) {
+    const int rayCount = std::min((int)rays.size(), 4096);
+    const int setSize = 1024;
+    std::vector<int> inner;
+    for (int i = 0; i < (int)nodes.size() && (int)inner.size() < setSize; i++) {
+        if (nodes[i].count == 0 && nodes[i].start > 0) inner.push_back(i);
+    }
+    int triCount = std::min((int)triangles.size(), setSize);
+
+    float sink = 0.0f;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rayCount; r++) {
+        for (int idx : inner) {
+            const Node& left = nodes[nodes[idx].start];
+            const Node& right = nodes[nodes[idx].start + 1];
+            sink += std::min(intersectAABB(rays[r], left.min, left.max), intersectAABB(rays[r], right.min, right.max));
+        }
+    }
+    visitSeconds = inner.empty() ? 0.0 : secondsSince(start) / ((double)rayCount * inner.size());
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rayCount; r++) {
+        for (int i = 0; i < triCount; i++) sink += intersectTriangle(triangles[i], rays[r]);
+    }
+    triSeconds = triCount == 0 ? 0.0 : secondsSince(start) / ((double)rayCount * triCount);
+
+    calibrationSink = sink;
+}
+
+static void rebuildScene() {
+    for (Mesh& mesh : meshes) {
+        rebuildBVH(mesh);
+        if (bvhSettings.optimize) optimizeBVH(mesh);
+        layoutBVH(mesh, bvhSettings.layout);
+    }
+}
+
+// Best of a few CPU traces of all rays through the mesh trees of every
+// instance, at the width the shader traverses.
+static double timeFrame(const std::vector<Ray>& rays, TraceStats& stats) {
+    const int repeats = 3;
+    TraceTrees trees = collapseTraceTrees(traceWidth(), bvhSettings.compress);
+    double best = DBL_MAX;
+    for (int k = 0; k < repeats; k++) {
+        stats = TraceStats();
+        auto start = std::chrono::steady_clock::now();
+        for (const Ray& ray : rays) traceInstances(trees, ray, FLT_MAX, &stats);
+        best = std::min(best, secondsSince(start));
+    }
+    return best;
+}
+
+void writeCostCalibration(std::ostream& out) {
+    std::vector<Ray> rays = benchmarkRays();
+    double visitSeconds, triSeconds;
+    measureOperations(rays, visitSeconds, triSeconds);
+    float measuredRatio = triSeconds > 0.0 ? (float)(visitSeconds / triSeconds) : 1.0f;
+
+    const float scales[] = { 0.25f, 0.5f, 1.0f, 2.0f, 4.0f };
+    const int leafSizes[] = { 4, 8, 16, 32 };
+    float bestTraversal = bvhSettings.traversalCost;
+    int bestLeafSize = bvhSettings.maxLeafSize;
+    double bestSeconds = DBL_MAX;
+
+    out << "{\n"
+        << "  \"builder\": \"" << builderName(bvhSettings.builder) << "\",\n"
+        << "  \"rays\": " << rays.size() << ",\n"
+        << "  \"width\": " << traceWidth() << ",\n"
+        << "  \"compressed\": " << (bvhSettings.compress ? "true" : "false") << ",\n"
+        << "  \"nodeVisitNs\": " << visitSeconds * 1e9 << ",\n"
+        << "  \"triangleTestNs\": " << triSeconds * 1e9 << ",\n"
+        << "  \"measuredRatio\": " << measuredRatio << ",\n"
+        << "  \"runs\": [\n";
+    bvhSettings.intersectionCost = 1.0f;
+    bool first = true;
+    for (float scale : scales) {
+        for (int leafSize : leafSizes) {
+            bvhSettings.traversalCost = measuredRatio * scale;
+            bvhSettings.maxLeafSize = leafSize;
+            rebuildScene();
+
+            float sah = 0.0f;
+            for (const Mesh& mesh : meshes) sah += computeSAH(mesh);
+            TraceStats stats;
+            double seconds = timeFrame(rays, stats);
+            if (seconds < bestSeconds) {
+                bestSeconds = seconds;
+                bestTraversal = bvhSettings.traversalCost;
+                bestLeafSize = leafSize;
+            }
+            out << (first ? "" : ",\n")
+                << "    { \"traversalCost\": " << bvhSettings.traversalCost
+                << ", \"maxLeafSize\": " << leafSize
+                << ", \"sah\": " << sah
+                << ", \"nodeVisits\": " << stats.nodeVisits
+                << ", \"triTests\": " << stats.triTests
+                << ", \"frameMs\": " << seconds * 1e3 << " }";
+            first = false;
+        }
+    }
+
+    bvhSettings.traversalCost = bestTraversal;
+    bvhSettings.maxLeafSize = bestLeafSize;
+    rebuildScene();
+    out << "\n  ],\n"
+        << "  \"best\": { \"traversalCost\": " << bestTraversal
+        << ", \"intersectionCost\": " << bvhSettings.intersectionCost
+        << ", \"maxLeafSize\": " << bestLeafSize
+        << ", \"frameMs\": " << bestSeconds * 1e3 << " }\n"
+        << "}\n";
+}
+
+static float bruteForceHit(const Mesh& mesh, const Ray& ray) {
+    float t = FLT_MAX;
+    for (int i = mesh.triStart; i < mesh.triStart + mesh.triCount; i++) t = std::min(t, intersectTriangle(triangles[i], ray));
+    return t;
+}
+
+// Rays between random points of the mesh's bounds on which traceBVH() and a
+// test of every triangle of the mesh disagree.
+static int mismatchedRays(const Mesh& mesh, int count) {
+    const Node& root = nodes[mesh.bvhRoot];
+    auto randomPoint = [&]() {
+        return vec3(rnd(root.min.x, root.max.x), rnd(root.min.y, root.max.y), rnd(root.min.z, root.max.z));
+    };
+    int mismatches = 0;
+    for (int r = 0; r < count; r++) {
+        vec3 origin = randomPoint();
+        vec3 dir = randomPoint() - origin;
+        if (dot(dir, dir) == 0.0f) continue;
+        Ray ray = makeRay(origin, normalize(dir));
+        float traced = traceBVH(mesh.bvhRoot, ray, FLT_MAX).t;
+        float expected = bruteForceHit(mesh, ray);
+        if (traced != expected && std::abs(traced - expected) > 1e-4f * std::max(1.0f, expected)) mismatches++;
+    }
+    return mismatches;
+}
+
+// Moves every vertex of tri by up to jitter along each axis.
+static void jitterTriangle(Tri& tri, float jitter) {
+    auto offset = [jitter]() { return vec3(rnd(-jitter, jitter), rnd(-jitter, jitter), rnd(-jitter, jitter)); };
+    tri.v0 += offset();
+    tri.v1 += offset();
+    tri.v2 += offset();
+    tri.min = min(tri.v0, min(tri.v1, tri.v2));
+    tri.max = max(tri.v0, max(tri.v1, tri.v2));
+    tri.c = (tri.v0 + tri.v1 + tri.v2) / 3.0f;
+}
+
+bool writeEditCheck(std::ostream& out) {
+    const int rayCount = 512;
+    srand(11);
+    int m = -1;
+    for (int i = 0; i < (int)meshes.size(); i++) {
+        if (meshes[i].bvhRoot >= 0 && (m < 0 || meshes[i].triCount > meshes[m].triCount)) m = i;
+    }
+    if (m < 0) return false;
+    Mesh& mesh = meshes[m];
+    vec3 meshMin = nodes[mesh.bvhRoot].min;
+    vec3 meshMax = nodes[mesh.bvhRoot].max;
+    float size = length(meshMax - meshMin);
+    vec3 sceneMin, sceneMax;
+    sceneBounds(sceneMin, sceneMax);
+
+    bool passed = true;
+    bool first = true;
+    out << "{\n"
+        << "  \"builder\": \"" << builderName(bvhSettings.builder) << "\",\n"
+        << "  \"mesh\": " << m << ",\n"
+        << "  \"steps\": [\n";
+    auto step = [&](const char* name, bool valid, int mismatches, bool rebuilt = false) {
+        passed = passed && valid && mismatches == 0;
+        out << (first ? "" : ",\n")
+            << "    { \"step\": \"" << name << "\", \"valid\": " << (valid ? "true" : "false")
+            << ", \"rayMismatches\": " << mismatches << ", \"rebuilt\": " << (rebuilt ? "true" : "false") << " }";
+        first = false;
+    };
+
+    // a small motion refits, a large one grows the SAH enough to rebuild
+    const float jitters[] = { 1e-4f, 0.2f };
+    for (int k = 0; k < 2; k++) {
+        for (int i = mesh.triStart; i < mesh.triStart + mesh.triCount; i++) jitterTriangle(triangles[i], jitters[k] * size);
+        bool rebuilt = refitBVH(mesh);
+        step(k == 0 ? "refitBVH" : "refitBVH large motion", validateBVH(mesh), mismatchedRays(mesh, rayCount), rebuilt);
+    }
+
+    // copies of the mesh's own triangles, moved somewhere inside its bounds
+    for (int i = 0; i < 256; i++) {
+        Tri tri = triangles[mesh.triStart + rnd(0, mesh.triCount)];
+        vec3 target = vec3(rnd(meshMin.x, meshMax.x), rnd(meshMin.y, meshMax.y), rnd(meshMin.z, meshMax.z));
+        apply_transform(tri, get_translation(target - tri.c));
+        insertTriangle(mesh, tri);
+    }
+    step("insertTriangle", validateBVH(mesh), mismatchedRays(mesh, rayCount));
+
+    for (int i = 0; i < 128 && mesh.triCount > 1; i++) removeTriangle(mesh, mesh.triStart + rnd(0, mesh.triCount));
+    step("removeTriangle", validateBVH(mesh), mismatchedRays(mesh, rayCount));
+
+    for (int i = 0; i < 64; i++) {
+        Sph sph;
+        sph.center = vec3(rnd(sceneMin.x, sceneMax.x), rnd(sceneMin.y, sceneMax.y), rnd(sceneMin.z, sceneMax.z));
+        sph.radius = rnd(0.05f, 0.5f);
+        sph.materialIdx = 0;
+        insertSphere(sph);
+    }
+    step("insertSphere", validateTLAS(), 0);
+
+    for (int i = 0; i < 32 && !spheres.empty(); i++) removeSphere(rnd(0, (int)spheres.size()));
+    step("removeSphere", validateTLAS(), 0);
+
+    insertInstance(m, get_translation(vec3(0.0f, size, 0.0f)));
+    step("insertInstance", validateTLAS(), 0);
+
+    for (int i = 0; i < (int)instances.size(); i++) {
+        vec3 shift = vec3(rnd(-0.1f, 0.1f), rnd(-0.1f, 0.1f), rnd(-0.1f, 0.1f)) * size;
+        moveInstance(i, get_translation(shift) * instanceToWorld(instances[i]));
+    }
+    updateTLAS();
+    step("moveInstance", validateTLAS(), 0);
+
+    out << "\n  ],\n"
+        << "  \"passed\": " << (passed ? "true" : "false") << "\n"
+        << "}\n";
+    return passed;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <ostream>
+#include <structs.hh>
+
+const char* builderName(BVHBuilder builder);
+
+// Writes quality statistics of every mesh BVH and of the TLAS as JSON:
+// SAH cost, EPO (end-point overlap, the triangle area from outside a subtree
+// that lies inside its node, relative to the mesh's total triangle area),
+// leaf size and leaf depth histograms, the empty-space ratio (the part of the
+// inner nodes' volume that neither child box covers) and node memory.
+void writeBVHAnalysis(std::ostream& out);
+
+const char* layoutName(BVHLayout layout);
+
+// Traces the camera's primary rays through every instance on the CPU once per
+// node layout, at the width the shader traverses, then through the last layout
+// collapsed to widths 2, 4 and 8 and quantized at 4 and 8, and writes the node
+// visits and simulated node-fetch cache misses as JSON. Leaves the BVHs in the
+// last layout.
+void writeLayoutBenchmark(std::ostream& out);
+
+// Times a node visit and a triangle test on this machine, then rebuilds every
+// mesh BVH over a grid of traversal costs around their ratio and of leaf
+// sizes, traces the benchmark rays on the CPU for each through trees of the
+// width the shader traverses and writes the frame times as JSON. Leaves
+// bvhSettings and the BVHs at the fastest setting.
+void writeCostCalibration(std::ostream& out);
+
+// Edits the built scene the way the dynamic scene API allows: moves the
+// triangles of the largest mesh and refits, once little and once enough to
+// rebuild, inserts and removes some of its triangles, then inserts and removes
+// spheres, adds an instance and moves every instance. Validates the touched trees and checks
+// rays through the mesh against a test of every triangle after each step.
+// Writes the results as JSON and returns false when any step failed.
+bool writeEditCheck(std::ostream& out);
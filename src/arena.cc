@@ -0,0 +1,46 @@
+#include <arena.hh>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+Arena::~Arena() {
+    for (Block& block : blocks) free(block.data);
+}
+
+void* Arena::allocBytes(size_t bytes, size_t align) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!blocks.empty()) {
+        uintptr_t base = (uintptr_t)blocks.back().data;
+        size_t aligned = ((base + offset + align - 1) & ~(uintptr_t)(align - 1)) - base;
+        if (aligned + bytes <= blocks.back().size) {
+            offset = aligned + bytes;
+            used += bytes;
+            return blocks.back().data + aligned;
+        }
+    }
+
+    // malloc aligns to max_align_t, which covers everything the builds store
+    size_t size = std::max(blockBytes, bytes);
+    char* data = static_cast<char*>(malloc(size));
+    if (!data) abort();
+    blocks.push_back({ data, size });
+    offset = bytes;
+    used += bytes;
+    return data;
+}
+
+void Arena::release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (blocks.size() > 1 || (!blocks.empty() && blocks.back().size > maxKeptBytes)) {
+        size_t total = 0;
+        for (Block& block : blocks) {
+            total += block.size;
+            free(block.data);
+        }
+        blocks.clear();
+        blockBytes = std::max(minBlockBytes, std::min(std::max(blockBytes, total), maxKeptBytes));
+    }
+    offset = 0;
+    used = 0;
+}
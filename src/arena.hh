@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for scratch memory with a common lifetime. Allocations are
+// never freed one by one, release() drops all of them at once. Safe to share
+// between the tasks of one build.
+class Arena {
+public:
+    explicit Arena(size_t blockBytes = 1 << 20, size_t maxKeptBytes = 64 << 20)
+        : minBlockBytes(blockBytes), maxKeptBytes(maxKeptBytes), blockBytes(blockBytes) {}
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Uninitialized room for count objects, valid until the next release().
+    template <typename T>
+    T* alloc(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return static_cast<T*>(allocBytes(count * sizeof(T), alignof(T)));
+    }
+
+    // Frees every allocation. When the last round needed several blocks they
+    // are replaced by one block of their combined size, so the next round of
+    // similar size allocates nothing. No block above maxKeptBytes is kept, a
+    // single huge build doesn't pin its peak scratch memory for good.
+    void release();
+
+    size_t bytesUsed() const { return used; }
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    void* allocBytes(size_t bytes, size_t align);
+
+    std::mutex mutex;
+    std::vector<Block> blocks;
+    size_t minBlockBytes;
+    size_t maxKeptBytes;
+    size_t blockBytes;
+    size_t offset = 0; // into blocks.back()
+    size_t used = 0;
+};
+
+// Arena memory viewed as an array, for the fixed size temporaries of a build.
+template <typename T>
+struct ScratchArray {
+    T* data = nullptr;
+    int count = 0;
+
+    ScratchArray() = default;
+    ScratchArray(Arena& arena, int count) : data(arena.alloc<T>(count)), count(count) {}
+
+    T& operator[](int i) { return data[i]; }
+    const T& operator[](int i) const { return data[i]; }
+    T* begin() { return data; }
+    T* end() { return data + count; }
+    const T* begin() const { return data; }
+    const T* end() const { return data + count; }
+    int size() const { return count; }
+};
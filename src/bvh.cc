@@ -1,22 +1,102 @@
 #include <glm/glm.hpp>
 #include <structs.hh>
 #include <bvh.hh>
+#include <arena.hh>
+#include <threadpool.hh>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 #include <functional>
+#include <iostream>
+
+struct Box {
+    vec3 min = vec3(FLT_MAX);
+    vec3 max = vec3(-FLT_MAX);
+
+    void grow(const vec3& p) { min = glm::min(min, p); max = glm::max(max, p); }
+    void grow(const Box& b) { min = glm::min(min, b.min); max = glm::max(max, b.max); }
+};
+
+BVHSettings bvhSettings;
+
+// Temporaries of the builds inside the current BuildScope, see below.
+static Arena buildScratch;
+
+// What the references of a running build index: triangles, or the presplit
+// pieces of the batch (see presplitTriangles()) until buildBatch() maps the
+// leaves back to triangles.
+static const std::vector<Tri>* buildTris = &triangles;
+
+static const Tri& buildTri(int ref) {
+    return (*buildTris)[ref];
+}
+
+// Builds and edits end in these, which validate while bvhSettings.validate is set.
+static void checkBVH(const Mesh& mesh) {
+    if (bvhSettings.validate) validateBVH(mesh);
+}
+
+static void checkTLAS() {
+    if (bvhSettings.validate) validateTLAS();
+}
+
+static bool isParallelRange(int count) {
+    return bvhSettings.parallel && count >= Config::parallelSplitMin;
+}
+
+// Runs fn over roughly equal chunks of [start, end) on the thread pool and
+// returns one result per chunk for the caller to merge.
+template <typename T, typename Fn>
+static std::vector<T> mapChunks(int start, int end, Fn fn) {
+    int count = end - start;
+    int chunks = (count + Config::parallelGrain - 1) / Config::parallelGrain;
+    int chunkSize = (count + chunks - 1) / chunks;
+    std::vector<T> results(chunks);
+    parallelFor(0, chunks, 1, [&](int c0, int c1) {
+        for (int c = c0; c < c1; c++) {
+            int lo = start + c * chunkSize;
+            results[c] = fn(lo, std::min(end, lo + chunkSize));
+        }
+    });
+    return results;
+}
+
+static Box triBounds(int start, int end) {
+    Box box;
+    for (int i = start; i < end; i++) {
+        const Tri& tri = buildTri(triIndices[i]);
+        box.min = min(box.min, tri.min);
+        box.max = max(box.max, tri.max);
+    }
+    return box;
+}
+
+static Box centroidBounds(int start, int end) {
+    Box box;
+    for (int i = start; i < end; i++) box.grow(buildTri(triIndices[i]).c);
+    return box;
+}
 
 void shrinkBounds(int nodeIdx) {
     Node* node = &nodes[nodeIdx];
-    node->min = vec3(FLT_MAX);
-    node->max = vec3(-FLT_MAX);
     int start = node->start;
     int end   = node->start + node->count;
-    for (int i = start; i < end; i++) {
-        Tri& tri = triangles[triIndices[i]];
-        node->min = min(node->min, tri.min);
-        node->max = max(node->max, tri.max);
+    Box box;
+    if (isParallelRange(node->count)) {
+        for (const Box& part : mapChunks<Box>(start, end, triBounds)) box.grow(part);
+    } else {
+        box = triBounds(start, end);
     }
+    node->min = box.min;
+    node->max = box.max;
 }
 
 void swap(int& a, int& b) {
@@ -30,6 +110,135 @@ float area(vec3 minv, vec3 maxv) {
     return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
 }
 
+// Camera-weighted SAH, after Bittner and Havran's ray distribution heuristic:
+// cameraWeight of the rays are taken to be the build camera's primary rays,
+// which hit a box with the probability of the part of the screen it covers,
+// and the rest to be spread evenly over the scene, which hit it in proportion
+// to its surface area. sahArea() is that hit probability times the scene's
+// area, so it is plain area() while no camera is set.
+struct BuildCamera {
+    bool active = false;
+    float weight;
+    Camera camera;
+    float tanHalfFov;
+    float nearPlane;
+    vec3 sceneMin;
+    vec3 sceneMax;
+    // seen from the space of the boxes being built, see placeBuildCamera():
+    // dot(p, axis[i]) + offset[i] are the camera's right, up and depth
+    // coordinates of a point p
+    vec3 axis[3];
+    vec3 offset;
+    float sceneArea;
+};
+static BuildCamera buildCamera;
+
+// Moves the build camera into the object space of a mesh placed by toWorld.
+// Exact for any affine transform, the scene area is scaled by the transform's
+// average area factor.
+static void placeBuildCamera(const mat4& toWorld) {
+    const Camera& cam = buildCamera.camera;
+    mat3 linear = mat3(toWorld);
+    vec3 eye = cam.position - vec3(toWorld[3]);
+    vec3 world[3] = { normalize(cross(cam.forward, cam.up)), cam.up, cam.forward / dot(cam.forward, cam.forward) };
+    for (int i = 0; i < 3; i++) {
+        buildCamera.axis[i] = transpose(linear) * world[i];
+        buildCamera.offset[i] = -dot(eye, world[i]);
+    }
+    float areaScale = pow(std::abs(determinant(linear)), 2.0f / 3.0f);
+    buildCamera.sceneArea = area(buildCamera.sceneMin, buildCamera.sceneMax) / std::max(areaScale, FLT_MIN);
+}
+
+// Part of the screen covered by the bounding rectangle of the box's
+// projection. The box is clipped against a plane just in front of the eye
+// first, so boxes reaching behind the camera still project to a finite rectangle.
+static float screenFraction(const vec3& minv, const vec3& maxv) {
+    float sx = buildCamera.tanHalfFov * buildCamera.camera.aspect;
+    float sy = buildCamera.tanHalfFov;
+
+    float nearPlane = buildCamera.nearPlane;
+    float x[8], y[8], z[8];
+    bool inFront = true;
+    for (int k = 0; k < 8; k++) {
+        vec3 corner = vec3(k & 1 ? maxv.x : minv.x, k & 2 ? maxv.y : minv.y, k & 4 ? maxv.z : minv.z);
+        x[k] = dot(corner, buildCamera.axis[0]) + buildCamera.offset.x;
+        y[k] = dot(corner, buildCamera.axis[1]) + buildCamera.offset.y;
+        z[k] = dot(corner, buildCamera.axis[2]) + buildCamera.offset.z;
+        inFront = inFront && z[k] >= nearPlane;
+    }
+
+    float lox = FLT_MAX, loy = FLT_MAX, hix = -FLT_MAX, hiy = -FLT_MAX;
+    auto project = [&](float px, float py, float pz) {
+        px /= pz * sx;
+        py /= pz * sy;
+        lox = std::min(lox, px);
+        hix = std::max(hix, px);
+        loy = std::min(loy, py);
+        hiy = std::max(hiy, py);
+    };
+    for (int k = 0; k < 8; k++) {
+        if (z[k] >= nearPlane) project(x[k], y[k], z[k]);
+        if (inFront) continue;
+        for (int bit = 1; bit < 8; bit <<= 1) {
+            int j = k | bit;
+            if (j == k || (z[k] >= nearPlane) == (z[j] >= nearPlane)) continue;
+            float t = (nearPlane - z[k]) / (z[j] - z[k]);
+            project(x[k] + t * (x[j] - x[k]), y[k] + t * (y[j] - y[k]), nearPlane);
+        }
+    }
+    if (lox > hix) return 0.0f;
+
+    float w = std::min(hix, 1.0f) - std::max(lox, -1.0f);
+    float h = std::min(hiy, 1.0f) - std::max(loy, -1.0f);
+    return w > 0.0f && h > 0.0f ? w * h * 0.25f : 0.0f;
+}
+
+static float sahArea(const vec3& minv, const vec3& maxv) {
+    if (!buildCamera.active) return area(minv, maxv);
+    float weight = buildCamera.weight;
+    return (1.0f - weight) * area(minv, maxv) + weight * buildCamera.sceneArea * screenFraction(minv, maxv);
+}
+
+void setBuildCamera(const Camera& cam, const vec3& sceneMin, const vec3& sceneMax) {
+    buildCamera.active = bvhSettings.cameraWeight > 0.0f;
+    // keep part of the area term, boxes off the screen would cost nothing and never be split otherwise
+    buildCamera.weight = std::min(bvhSettings.cameraWeight, Config::maxCameraWeight);
+    buildCamera.camera = cam;
+    buildCamera.tanHalfFov = tan(cam.fov / 2.0f);
+    buildCamera.nearPlane = 1e-4f * length(sceneMax - sceneMin);
+    buildCamera.sceneMin = sceneMin;
+    buildCamera.sceneMax = sceneMax;
+    placeBuildCamera(mat4(1.0f));
+}
+
+void clearBuildCamera() {
+    buildCamera.active = false;
+}
+
+bool hasBuildCamera() {
+    return buildCamera.active;
+}
+
+bool buildCameraMoved(const Camera& cam) {
+    if (!buildCamera.active) return false;
+    const Camera& built = buildCamera.camera;
+    float distance = length(cam.position - built.position);
+    float cosAngle = dot(normalize(cam.forward), normalize(built.forward));
+    return distance > Config::cameraRebuildDistance * length(buildCamera.sceneMax - buildCamera.sceneMin) ||
+           cosAngle < cos(radians(Config::cameraRebuildAngle));
+}
+
+// SAH costs with the tunable constants. Split searches return the sum of
+// count * area over both children, splitCost() prices that as two leaves
+// below an inner node of the given area.
+static float leafCost(float boxArea, int count) {
+    return bvhSettings.intersectionCost * boxArea * count;
+}
+
+static float splitCost(float boxArea, float childCost) {
+    return bvhSettings.traversalCost * boxArea + bvhSettings.intersectionCost * childCost;
+}
+
 float evalSAH( Node node, int axis, float splitPos ) {
     struct Bounds {
         vec3 min;
@@ -50,7 +259,7 @@ float evalSAH( Node node, int axis, float splitPos ) {
     int start = node.start;
     int end   = node.start + node.count;
     for (int i = start; i < end; i++) {
-        Tri& tri = triangles[triIndices[i]];
+        const Tri& tri = buildTri(triIndices[i]);
         if (tri.c[axis] < splitPos) {
             left.min = min(left.min, tri.min);
             left.max = max(left.max, tri.max);
@@ -61,204 +270,3207 @@ float evalSAH( Node node, int axis, float splitPos ) {
             right.count++;
         }
     }
-    float cost = left.count * area(left.min, left.max) + right.count * area(right.min, right.max);
+    float cost = left.count * sahArea(left.min, left.max) + right.count * sahArea(right.min, right.max);
     return cost;
 }
 
-int usedNodes = 0;
+struct Bin {
+    vec3 min;
+    vec3 max;
+    int count;
+};
 
-void subdivide(int idx, int depth = 0) {
-    Node& node = nodes[idx];
-    if (node.count <= Config::minVolumeAmount || depth >= Config::maxBVHDepth) return;
+struct BinGrid {
+    Bin bins[3][Config::maxSahBins];
 
-    int bestSplit = -1;
-    int axis = 0;
-    float parentCost = area( node.min, node.max ) * node.count;
-    float bestCost = parentCost;
+    void clear(int binCount) {
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < binCount; b++) {
+                bins[a][b].min = vec3(FLT_MAX);
+                bins[a][b].max = vec3(-FLT_MAX);
+                bins[a][b].count = 0;
+            }
+        }
+    }
+
+    void merge(const BinGrid& other, int binCount) {
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < binCount; b++) {
+                bins[a][b].min = min(bins[a][b].min, other.bins[a][b].min);
+                bins[a][b].max = max(bins[a][b].max, other.bins[a][b].max);
+                bins[a][b].count += other.bins[a][b].count;
+            }
+        }
+    }
+};
+
+std::atomic<int> usedNodes{0};
+
+float findBestSplitSweep(const Node& node, int& axis, float& splitPos) {
+    float bestCost = FLT_MAX;
     for (int a = 0; a < 3; ++a) {
         for (int k = node.start; k < node.start + node.count; ++k) {
-            float cost = evalSAH( node, a, triangles[triIndices[k]].c[a] );
+            float candidate = buildTri(triIndices[k]).c[a];
+            float cost = evalSAH( node, a, candidate );
+            if (cost < bestCost) {
+                bestCost = cost;
+                splitPos = candidate;
+                axis = a;
+            }
+        }
+    }
+    return bestCost;
+}
+
+static void fillBins(BinGrid& grid, int start, int end, int binCount, const Box& cbox, const vec3& scale) {
+    grid.clear(binCount);
+    for (int i = start; i < end; i++) {
+        const Tri& tri = buildTri(triIndices[i]);
+        for (int a = 0; a < 3; a++) {
+            int b = clamp((int)((tri.c[a] - cbox.min[a]) * scale[a]), 0, binCount - 1);
+            Bin& bin = grid.bins[a][b];
+            bin.min = min(bin.min, tri.min);
+            bin.max = max(bin.max, tri.max);
+            bin.count++;
+        }
+    }
+}
+
+float findBestSplitBinned(const Node& node, int& axis, float& splitPos) {
+    int binCount = clamp(bvhSettings.bins, 2, Config::maxSahBins);
+    int start = node.start;
+    int end   = node.start + node.count;
+    bool parallel = isParallelRange(node.count);
+
+    Box cbox;
+    if (parallel) {
+        for (const Box& part : mapChunks<Box>(start, end, centroidBounds)) cbox.grow(part);
+    } else {
+        cbox = centroidBounds(start, end);
+    }
+
+    vec3 extent = cbox.max - cbox.min;
+    vec3 scale;
+    for (int a = 0; a < 3; a++) scale[a] = extent[a] > 0.0f ? binCount / extent[a] : 0.0f;
+
+    BinGrid grid;
+    if (parallel) {
+        std::vector<BinGrid> parts = mapChunks<BinGrid>(start, end, [&](int lo, int hi) {
+            BinGrid part;
+            fillBins(part, lo, hi, binCount, cbox, scale);
+            return part;
+        });
+        grid.clear(binCount);
+        for (const BinGrid& part : parts) grid.merge(part, binCount);
+    } else {
+        fillBins(grid, start, end, binCount, cbox, scale);
+    }
+
+    float bestCost = FLT_MAX;
+    for (int a = 0; a < 3; ++a) {
+        if (extent[a] <= 0.0f) continue;
+        const Bin* bins = grid.bins[a];
+
+        // sweep from the left storing prefix costs, then from the right to combine
+        float leftArea[Config::maxSahBins];
+        int leftCount[Config::maxSahBins];
+        vec3 lmin = vec3(FLT_MAX), lmax = vec3(-FLT_MAX);
+        int lcount = 0;
+        for (int b = 0; b < binCount - 1; b++) {
+            lcount += bins[b].count;
+            lmin = min(lmin, bins[b].min);
+            lmax = max(lmax, bins[b].max);
+            leftCount[b] = lcount;
+            leftArea[b] = lcount > 0 ? sahArea(lmin, lmax) : 0.0f;
+        }
+
+        vec3 rmin = vec3(FLT_MAX), rmax = vec3(-FLT_MAX);
+        int rcount = 0;
+        for (int b = binCount - 1; b > 0; b--) {
+            rcount += bins[b].count;
+            rmin = min(rmin, bins[b].min);
+            rmax = max(rmax, bins[b].max);
+            float rightArea = rcount > 0 ? sahArea(rmin, rmax) : 0.0f;
+            float cost = leftCount[b - 1] * leftArea[b - 1] + rcount * rightArea;
             if (cost < bestCost) {
                 bestCost = cost;
-                bestSplit = k;
                 axis = a;
+                splitPos = cbox.min[a] + extent[a] * b / binCount;
             }
         }
     }
+    return bestCost;
+}
+
+// Stable two-pass partition of a large range: count per chunk, then scatter
+// every chunk into its final slot through a scratch copy.
+static int partitionParallel(int start, int count, int axis, float splitPos) {
+    int end = start + count;
+    std::vector<int> leftCounts = mapChunks<int>(start, end, [&](int lo, int hi) {
+        int n = 0;
+        for (int i = lo; i < hi; i++) n += buildTri(triIndices[i]).c[axis] < splitPos;
+        return n;
+    });
+
+    int chunks = (int)leftCounts.size();
+    int chunkSize = (count + chunks - 1) / chunks;
+    std::vector<int> leftOffset(chunks);
+    std::vector<int> rightOffset(chunks);
+    int totalLeft = 0;
+    for (int c = 0; c < chunks; c++) {
+        leftOffset[c] = totalLeft;
+        totalLeft += leftCounts[c];
+    }
+    for (int c = 0; c < chunks; c++) {
+        rightOffset[c] = totalLeft + c * chunkSize - leftOffset[c];
+    }
 
-    if (bestCost >= parentCost) return;
+    // not from buildScratch: every level of the split recursion partitions
+    // again, and arena memory would only come back when the whole build ends
+    std::vector<int> scratch(count);
+    parallelFor(0, chunks, 1, [&](int c0, int c1) {
+        for (int c = c0; c < c1; c++) {
+            int lo = start + c * chunkSize;
+            int hi = std::min(end, lo + chunkSize);
+            int l = leftOffset[c];
+            int r = rightOffset[c];
+            for (int i = lo; i < hi; i++) {
+                int idx = triIndices[i];
+                if (buildTri(idx).c[axis] < splitPos) scratch[l++] = idx;
+                else scratch[r++] = idx;
+            }
+        }
+    });
+    parallelFor(0, count, Config::parallelGrain, [&](int lo, int hi) {
+        std::copy(scratch.begin() + lo, scratch.begin() + hi, triIndices.begin() + start + lo);
+    });
+    return totalLeft;
+}
 
-    float splitPos = triangles[triIndices[bestSplit]].c[axis];
+static int partition(int start, int count, int axis, float splitPos) {
+    if (isParallelRange(count)) return partitionParallel(start, count, axis, splitPos);
 
-    int i = node.start;
-    int j = i + node.count - 1;
+    int i = start;
+    int j = i + count - 1;
     while (i <= j) {
-        if (triangles[triIndices[i]].c[axis] < splitPos) i++;
+        if (buildTri(triIndices[i]).c[axis] < splitPos) i++;
         else swap( triIndices[i], triIndices[j--] );
     }
-    int leftCount = i - node.start;
-    if (leftCount == 0 || leftCount == node.count) return;
+    return i - start;
+}
+
+// Object median along the widest centroid axis, or just the middle of the
+// range when all centroids coincide. Neither half is ever empty, so building
+// always terminates once it falls back to this.
+static int splitMedian(const Node& node) {
+    Box cbox = centroidBounds(node.start, node.start + node.count);
+    vec3 extent = cbox.max - cbox.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    int half = node.count / 2;
+    if (extent[axis] > 0.0f) {
+        auto begin = triIndices.begin() + node.start;
+        std::nth_element(begin, begin + half, begin + node.count, [axis](int a, int b) {
+            return buildTri(a).c[axis] < buildTri(b).c[axis];
+        });
+    }
+    return half;
+}
+
+// Splits idx into a child pair taken from nextNode and returns the left child, or -1 when the
+// node stays a leaf because no split is cheaper under the SAH. Leaves above
+// maxLeafSize triangles are always split, and past maxBVHDepth only at the
+// median, which keeps degenerate inputs within the traversal stack depth
+// instead of leaving them in one huge leaf.
+static int splitNode(int idx, int depth, std::atomic<int>& nextNode) {
+    Node& node = nodes[idx];
+    if (node.count <= Config::minVolumeAmount) return -1;
+
+    int axis = 0;
+    float splitPos = 0.0f;
+    float parentArea = sahArea( node.min, node.max );
+    float bestCost = bvhSettings.builder == BVHBuilder::Binned
+        ? findBestSplitBinned( node, axis, splitPos )
+        : findBestSplitSweep( node, axis, splitPos );
 
-    int leftChildIdx = usedNodes++;
-    int rightChildIdx = usedNodes++;
+    bool cheaper = bestCost < FLT_MAX && splitCost( parentArea, bestCost ) < leafCost( parentArea, node.count );
+    if (!cheaper && node.count <= bvhSettings.maxLeafSize) return -1;
+
+    int leftCount = 0;
+    if (depth < Config::maxBVHDepth && bestCost < FLT_MAX) leftCount = partition( node.start, node.count, axis, splitPos );
+    if (leftCount == 0 || leftCount == node.count) leftCount = splitMedian( node );
+
+    // children are allocated as an adjacent pair, the traversal relies on right == left + 1
+    int leftChildIdx = nextNode.fetch_add(2);
+    int rightChildIdx = leftChildIdx + 1;
 
     nodes[leftChildIdx].start = node.start;
     nodes[leftChildIdx].count = leftCount;
 
-    nodes[rightChildIdx].start = i;
+    nodes[rightChildIdx].start = node.start + leftCount;
     nodes[rightChildIdx].count = node.count - leftCount;
-    
+
     node.start = leftChildIdx;
     node.count = 0;
 
     shrinkBounds( leftChildIdx );
     shrinkBounds( rightChildIdx );
+    return leftChildIdx;
+}
+
+// Works through the subtree below root from an explicit stack. Every node big
+// enough to pay for a task hands its left child to the pool, so the upper
+// levels fan out across the workers while small subtrees stay on one thread.
+// Splits past maxBVHDepth halve the node, so no path gets more than 32 levels
+// deeper than that and the stack, one pending sibling per level, stays small.
+static void subdivideFrom(int root, int rootDepth, std::atomic<int>& nextNode, TaskGroup& group) {
+    std::pair<int, int> stack[Config::maxBVHDepth + 33];
+    int stackSize = 0;
+    stack[stackSize++] = { root, rootDepth };
+    while (stackSize > 0) {
+        std::pair<int, int> item = stack[--stackSize];
+        int depth = item.second;
+        bool fork = bvhSettings.parallel && nodes[item.first].count >= Config::parallelTaskMin;
+
+        int left = splitNode( item.first, depth, nextNode );
+        if (left < 0) continue;
+
+        stack[stackSize++] = { left + 1, depth + 1 };
+        if (fork) {
+            threadPool().submit(group, [left, depth, &nextNode, &group] { subdivideFrom( left, depth + 1, nextNode, group ); });
+        } else {
+            stack[stackSize++] = { left, depth + 1 };
+        }
+    }
+}
 
-    subdivide( leftChildIdx, depth + 1 );
-    subdivide( rightChildIdx, depth + 1 );
+// depth is the level of idx in its tree, so subtrees handed over by other
+// builders keep counting towards maxBVHDepth.
+void subdivide(int idx, int depth, std::atomic<int>& nextNode) {
+    TaskGroup group;
+    subdivideFrom( idx, depth, nextNode, group );
+    threadPool().wait(group);
 }
 
-void buildBVH(Mesh& mesh) {
-    nodes.resize(usedNodes + mesh.triCount * 2 - 1);
-    int idx = usedNodes++;
-    nodes[idx].start = mesh.triStart;
-    nodes[idx].count = mesh.triCount;
-    shrinkBounds( idx );
-    subdivide( idx );
-    mesh.bvhRoot = idx;
-    nodes.resize(usedNodes);
+// Spreads the low 10 bits of v so that two zero bits separate each of them.
+static uint64_t expandBits10(uint64_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x30000ff;
+    v = (v | (v << 8))  & 0x300f00f;
+    v = (v | (v << 4))  & 0x30c30c3;
+    v = (v | (v << 2))  & 0x9249249;
+    return v;
 }
 
-void buildBVHs(std::vector<Mesh>& meshes) {
-    for (Mesh& mesh : meshes) buildBVH(mesh);
+// Same as expandBits10 for the low 21 bits of v.
+static uint64_t expandBits21(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x1f00000000ffffull;
+    v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+    v = (v | (v << 8))  & 0x100f00f00f00f00full;
+    v = (v | (v << 4))  & 0x10c30c30c30c30c3ull;
+    v = (v | (v << 2))  & 0x1249249249249249ull;
+    return v;
 }
 
-static float getArea(const TLAS& a, const TLAS& b) {
-    vec3 minv = min(vec3(a.min), vec3(b.min));
-    vec3 maxv = max(vec3(a.max), vec3(b.max));
-    return area(minv, maxv);
+static uint64_t mortonCode(const vec3& p, int bits) {
+    if (bits > 30) {
+        return (expandBits21((uint64_t)p.x) << 2) | (expandBits21((uint64_t)p.y) << 1) | expandBits21((uint64_t)p.z);
+    }
+    return (expandBits10((uint64_t)p.x) << 2) | (expandBits10((uint64_t)p.y) << 1) | expandBits10((uint64_t)p.z);
 }
 
-static bool findBestPairIdx(const std::vector<TLAS>& allEntries, const std::vector<int>& active, int& outActiveA, int& outActiveB) {
-    float bestCost = FLT_MAX;
-    bool found = false;
+// Least significant digit radix sort of (key, value) pairs, 8 bits per pass.
+// Every chunk builds its own histogram so both histogram and scatter run in parallel.
+static void radixSort(ScratchArray<uint64_t>& keys, ScratchArray<int>& values, int bits) {
+    int n = keys.size();
+    int chunks = isParallelRange(n) ? (n + Config::parallelGrain - 1) / Config::parallelGrain : 1;
+    int chunkSize = (n + chunks - 1) / chunks;
 
-    for (int i = 0; i < (int)active.size(); ++i) {
-        for (int j = i + 1; j < (int)active.size(); ++j) {
-            float cost = getArea(allEntries[active[i]], allEntries[active[j]]);
-            if (cost < bestCost) {
-                bestCost = cost;
-                outActiveA = i;
-                outActiveB = j;
-                found = true;
+    ScratchArray<uint64_t> keysTmp(buildScratch, n);
+    ScratchArray<int> valuesTmp(buildScratch, n);
+    std::vector<std::array<int, 256>> offsets(chunks);
+
+    for (int shift = 0; shift < bits; shift += 8) {
+        parallelFor(0, chunks, 1, [&](int c0, int c1) {
+            for (int c = c0; c < c1; c++) {
+                offsets[c].fill(0);
+                int hi = std::min(n, (c + 1) * chunkSize);
+                for (int i = c * chunkSize; i < hi; i++) offsets[c][(keys[i] >> shift) & 0xff]++;
+            }
+        });
+
+        int sum = 0;
+        for (int d = 0; d < 256; d++) {
+            for (int c = 0; c < chunks; c++) {
+                int count = offsets[c][d];
+                offsets[c][d] = sum;
+                sum += count;
             }
         }
+
+        parallelFor(0, chunks, 1, [&](int c0, int c1) {
+            for (int c = c0; c < c1; c++) {
+                int hi = std::min(n, (c + 1) * chunkSize);
+                for (int i = c * chunkSize; i < hi; i++) {
+                    int pos = offsets[c][(keys[i] >> shift) & 0xff]++;
+                    keysTmp[pos] = keys[i];
+                    valuesTmp[pos] = values[i];
+                }
+            }
+        });
+        std::swap(keys, keysTmp);
+        std::swap(values, valuesTmp);
     }
-    return found;
 }
 
-static std::vector<TLAS> getOrdered(const std::vector<TLAS>& allEntries, int rootIdx) {
-    std::vector<TLAS> ordered;
-    ordered.reserve(allEntries.size());
-    std::vector<int> remap(allEntries.size(), -1);
+// Returns the first index in [lo, hi) that has the range's highest differing
+// code bit set, or the middle of the range when all codes are equal.
+static int findMortonSplit(const uint64_t* codes, int lo, int hi) {
+    uint64_t first = codes[lo];
+    uint64_t last = codes[hi - 1];
+    if (first == last) return (lo + hi) / 2;
+
+    int bit = 63;
+    while (!((first ^ last) >> bit & 1)) bit--;
 
-    std::function<int(int)> dfs = [&](int oldIdx) -> int {
-        int& newIdx = remap[oldIdx];
-        if (newIdx != -1) return newIdx;
+    int a = lo;
+    int b = hi - 1;
+    while (a + 1 < b) {
+        int mid = (a + b) / 2;
+        if (codes[mid] >> bit & 1) b = mid;
+        else a = mid;
+    }
+    return b;
+}
 
-        newIdx = (int)ordered.size();
-        ordered.push_back(allEntries[oldIdx]);
+static void emitLBVH(int idx, int depth, int lo, int hi, int offset, const uint64_t* codes, std::atomic<int>& nextNode) {
+    Node& node = nodes[idx];
+    int count = hi - lo;
+    node.start = offset + lo;
+    node.count = count;
 
-        TLAS& n = ordered.back();
-        if (n.idx == -1) {
-            int lNew = dfs(n.left);
-            int rNew = dfs(n.right);
-            n.left = lNew;
-            n.right = rNew;
-        } else {
-            n.left = 0;
-            n.right = 0;
+    if (count <= bvhSettings.lbvhTreeletSize) {
+        shrinkBounds( idx );
+        subdivide( idx, depth, nextNode );
+        return;
+    }
+    if (count <= Config::minVolumeAmount) {
+        shrinkBounds( idx );
+        return;
+    }
+
+    int split = findMortonSplit(codes, lo, hi);
+    int leftChildIdx = nextNode.fetch_add(2);
+    int rightChildIdx = leftChildIdx + 1;
+
+    node.start = leftChildIdx;
+    node.count = 0;
+
+    if (bvhSettings.parallel && count >= Config::parallelTaskMin) {
+        TaskGroup group;
+        threadPool().submit(group, [=, &nextNode] { emitLBVH( leftChildIdx, depth + 1, lo, split, offset, codes, nextNode ); });
+        emitLBVH( rightChildIdx, depth + 1, split, hi, offset, codes, nextNode );
+        threadPool().wait(group);
+    } else {
+        emitLBVH( leftChildIdx, depth + 1, lo, split, offset, codes, nextNode );
+        emitLBVH( rightChildIdx, depth + 1, split, hi, offset, codes, nextNode );
+    }
+
+    node.min = min(nodes[leftChildIdx].min, nodes[rightChildIdx].min);
+    node.max = max(nodes[leftChildIdx].max, nodes[rightChildIdx].max);
+}
+
+// Linear BVH: sorts the triangles of the root range along a Morton curve and
+// splits ranges at the highest differing code bit. Ranges at or below
+// lbvhTreeletSize are handed to the SAH builder to recover quality near the leaves.
+void buildLBVH(int rootIdx, std::atomic<int>& nextNode) {
+    int start = nodes[rootIdx].start;
+    int count = nodes[rootIdx].count;
+    int bits = bvhSettings.mortonBits > 30 ? 63 : 30;
+    float cells = (float)((1 << (bits / 3)) - 1);
+
+    Box cbox;
+    if (isParallelRange(count)) {
+        for (const Box& part : mapChunks<Box>(start, start + count, centroidBounds)) cbox.grow(part);
+    } else {
+        cbox = centroidBounds(start, start + count);
+    }
+    vec3 extent = cbox.max - cbox.min;
+    vec3 scale;
+    for (int a = 0; a < 3; a++) scale[a] = extent[a] > 0.0f ? cells / extent[a] : 0.0f;
+
+    ScratchArray<uint64_t> codes(buildScratch, count);
+    ScratchArray<int> ids(buildScratch, count);
+    parallelFor(0, count, Config::parallelGrain, [&](int lo, int hi) {
+        for (int i = lo; i < hi; i++) {
+            ids[i] = triIndices[start + i];
+            vec3 q = clamp((buildTri(ids[i]).c - cbox.min) * scale, 0.0f, cells);
+            codes[i] = mortonCode(q, bits);
         }
+    });
 
-        return newIdx;
-    };
+    radixSort(codes, ids, bits);
+    std::copy(ids.begin(), ids.end(), triIndices.begin() + start);
 
-    dfs(rootIdx);
-    return ordered;
+    emitLBVH(rootIdx, 0, 0, count, start, codes.data, nextNode);
 }
 
-void buildTLAS() {
-    std::vector<TLAS> allEntries;
-    std::vector<int> active;
+// Node of the bottom-up clustering. The first entries are the primitives in
+// Morton order, every merge appends a parent after both of its children.
+struct Cluster {
+    Box box;
+    int left;  // -1 for primitives
+    int right;
+    int prim;  // primitive index for leaves, -1 otherwise
+    int count;
+    float cost; // SAH cost of the best subtree below
+};
+
+static int findNearest(const std::vector<Cluster>& clusters, const std::vector<int>& active, int i, int radius) {
+    int m = (int)active.size();
+    const Box& box = clusters[active[i]].box;
+    float bestArea = FLT_MAX;
+    int best = -1;
+    for (int j = std::max(0, i - radius); j <= std::min(m - 1, i + radius); j++) {
+        if (j == i) continue;
+        const Box& other = clusters[active[j]].box;
+        float a = sahArea(min(box.min, other.min), max(box.max, other.max));
+        if (a < bestArea) {
+            bestArea = a;
+            best = j;
+        }
+    }
+    return best;
+}
 
-    allEntries.reserve(meshes.size() + spheres.size());
-    active.reserve(meshes.size() + spheres.size());
+static Cluster mergeClusters(const std::vector<Cluster>& clusters, int a, int b) {
+    const Cluster& l = clusters[a];
+    const Cluster& r = clusters[b];
+    Cluster parent;
+    parent.box = l.box;
+    parent.box.grow(r.box);
+    parent.left = a;
+    parent.right = b;
+    parent.prim = -1;
+    parent.count = l.count + r.count;
+    float parentArea = sahArea(parent.box.min, parent.box.max);
+    parent.cost = bvhSettings.traversalCost * parentArea + l.cost + r.cost;
+    if (parent.count <= bvhSettings.maxLeafSize) parent.cost = std::min(parent.cost, leafCost(parentArea, parent.count));
+    return parent;
+}
 
-    for (int i = 0; i < (int)meshes.size(); ++i) {
-        if (meshes[0].bvhRoot < 0) continue;
+// Parallel locally-ordered clustering (Meister and Bittner): every cluster
+// looks for its nearest neighbour among the radius clusters on each side of
+// it in Morton order, mutual nearest neighbours are merged, repeat until one
+// cluster remains. Returns all clusters with the root last. A radius below
+// one would leave every cluster without a neighbour, so it is raised to one.
+static std::vector<Cluster> clusterPLOC(const Box* boxes, int n, int radius) {
+    radius = std::max(1, radius);
+    std::vector<Cluster> clusters;
+    clusters.reserve(2 * n - 1);
 
-        const Node& root = nodes[meshes[i].bvhRoot];
+    Box cbox;
+    for (int i = 0; i < n; i++) cbox.grow((boxes[i].min + boxes[i].max) * 0.5f);
+    vec3 extent = cbox.max - cbox.min;
+    float cells = (float)((1 << 10) - 1);
+    vec3 scale;
+    for (int a = 0; a < 3; a++) scale[a] = extent[a] > 0.0f ? cells / extent[a] : 0.0f;
 
-        TLAS entry;
-        entry.min = vec4(root.min, 1.0f);
-        entry.max = vec4(root.max, 1.0f);
-        entry.idx = i;
-        entry.type = 0;
-        entry.left = 0;
-        entry.right = 0;
+    ScratchArray<uint64_t> codes(buildScratch, n);
+    ScratchArray<int> order(buildScratch, n);
+    parallelFor(0, n, Config::parallelGrain, [&](int lo, int hi) {
+        for (int i = lo; i < hi; i++) {
+            vec3 q = clamp(((boxes[i].min + boxes[i].max) * 0.5f - cbox.min) * scale, 0.0f, cells);
+            codes[i] = mortonCode(q, 30);
+            order[i] = i;
+        }
+    });
+    radixSort(codes, order, 30);
 
-        allEntries.push_back(entry);
-        active.push_back((int)allEntries.size() - 1);
+    for (int prim : order) {
+        const Box& box = boxes[prim];
+        clusters.push_back({ box, -1, -1, prim, 1, leafCost(sahArea(box.min, box.max), 1) });
     }
 
-    for (int si = 0; si < (int)spheres.size(); ++si) {
-        const Sph& sph = spheres[si];
+    std::vector<int> active(n);
+    for (int i = 0; i < n; i++) active[i] = i;
+    std::vector<int> nearest;
+    std::vector<int> mergeSlot;
 
-        TLAS entry;
-        entry.min = vec4(sph.center - vec3(sph.radius), 1.0f);
-        entry.max = vec4(sph.center + vec3(sph.radius), 1.0f);
-        entry.idx = si;
-        entry.type = 1;
-        entry.left = 0;
-        entry.right = 0;
+    while (active.size() > 1) {
+        int m = (int)active.size();
+        nearest.resize(m);
+        mergeSlot.resize(m);
 
-        allEntries.push_back(entry);
-        active.push_back((int)allEntries.size() - 1);
+        parallelFor(0, m, Config::parallelGrain / 16, [&](int lo, int hi) {
+            for (int i = lo; i < hi; i++) nearest[i] = findNearest(clusters, active, i, radius);
+        });
+
+        int base = (int)clusters.size();
+        int merges = 0;
+        // a cluster without a neighbour (best == -1) is kept for the next pass
+        for (int i = 0; i < m; i++) {
+            bool merge = nearest[i] >= 0 && nearest[nearest[i]] == i && i < nearest[i];
+            mergeSlot[i] = merge ? merges++ : -1;
+        }
+        if (merges == 0) {
+            // only possible on exact ties, force progress with the first pair
+            nearest[0] = 1;
+            nearest[1] = 0;
+            mergeSlot[0] = merges++;
+        }
+
+        clusters.resize(base + merges);
+        parallelFor(0, m, Config::parallelGrain, [&](int lo, int hi) {
+            for (int i = lo; i < hi; i++) {
+                if (mergeSlot[i] < 0) continue;
+                clusters[base + mergeSlot[i]] = mergeClusters(clusters, active[i], active[nearest[i]]);
+            }
+        });
+
+        int kept = 0;
+        for (int i = 0; i < m; i++) {
+            if (mergeSlot[i] >= 0) active[kept++] = base + mergeSlot[i];
+            else if (nearest[i] < 0 || mergeSlot[nearest[i]] < 0 || nearest[nearest[i]] != i) active[kept++] = active[i];
+        }
+        active.resize(kept);
     }
+    return clusters;
+}
 
-    if (active.empty()) {
-        tlas.clear();
+// Writes the ids of the primitives below cluster c to out from offset on and
+// returns the offset behind them.
+static int collectPrims(const std::vector<Cluster>& clusters, int c, const int* ids, int* out, int offset) {
+    const Cluster& cl = clusters[c];
+    if (cl.prim >= 0) {
+        out[offset] = ids[cl.prim];
+        return offset + 1;
+    }
+    offset = collectPrims(clusters, cl.left, ids, out, offset);
+    return collectPrims(clusters, cl.right, ids, out, offset);
+}
+
+// Whether the subtree below cluster cl is emitted as a single leaf, which it
+// is where that is no more expensive under SAH.
+static bool isLeafCluster(const std::vector<Cluster>& clusters, const Cluster& cl) {
+    if (cl.prim >= 0 || cl.count <= Config::minVolumeAmount) return true;
+    float a = sahArea(cl.box.min, cl.box.max);
+    return cl.count <= bvhSettings.maxLeafSize &&
+           leafCost(a, cl.count) <= bvhSettings.traversalCost * a + clusters[cl.left].cost + clusters[cl.right].cost;
+}
+
+// Writes the cluster tree below c into nodes[idx].
+static void emitPLOC(int idx, int c, int offset, const std::vector<Cluster>& clusters, const int* tris,
+                     std::atomic<int>& nextNode) {
+    const Cluster& cl = clusters[c];
+    Node& node = nodes[idx];
+    node.min = cl.box.min;
+    node.max = cl.box.max;
+
+    if (isLeafCluster(clusters, cl)) {
+        collectPrims(clusters, c, tris, triIndices.data(), offset);
+        node.start = offset;
+        node.count = cl.count;
         return;
     }
 
-    while (active.size() > 1) {
-        int aPos = -1, bPos = -1;
-        if (!findBestPairIdx(allEntries, active, aPos, bPos)) break;
+    int leftChildIdx = nextNode.fetch_add(2);
+    int rightChildIdx = leftChildIdx + 1;
+    node.start = leftChildIdx;
+    node.count = 0;
 
-        int aIdx = active[aPos];
-        int bIdx = active[bPos];
+    int rightOffset = offset + clusters[cl.left].count;
+    if (bvhSettings.parallel && cl.count >= Config::parallelTaskMin) {
+        TaskGroup group;
+        threadPool().submit(group, [=, &clusters, &nextNode] {
+            emitPLOC( leftChildIdx, cl.left, offset, clusters, tris, nextNode );
+        });
+        emitPLOC( rightChildIdx, cl.right, rightOffset, clusters, tris, nextNode );
+        threadPool().wait(group);
+    } else {
+        emitPLOC( leftChildIdx, cl.left, offset, clusters, tris, nextNode );
+        emitPLOC( rightChildIdx, cl.right, rightOffset, clusters, tris, nextNode );
+    }
+}
 
-        const TLAS& a = allEntries[aIdx];
-        const TLAS& b = allEntries[bIdx];
+void buildPLOC(int rootIdx, std::atomic<int>& nextNode) {
+    int start = nodes[rootIdx].start;
+    int count = nodes[rootIdx].count;
 
-        TLAS parent;
-        parent.min = min(a.min, b.min);
-        parent.max = max(a.max, b.max);
-        parent.idx = -1;
-        parent.type = -1;
-        parent.left = aIdx;
-        parent.right = bIdx;
+    ScratchArray<int> tris(buildScratch, count);
+    ScratchArray<Box> boxes(buildScratch, count);
+    for (int i = 0; i < count; i++) {
+        tris[i] = triIndices[start + i];
+        boxes[i].min = buildTri(tris[i]).min;
+        boxes[i].max = buildTri(tris[i]).max;
+    }
 
-        allEntries.push_back(parent);
-        int pIdx = (int)allEntries.size() - 1;
+    std::vector<Cluster> clusters = clusterPLOC(boxes.data, count, bvhSettings.plocRadius);
+    emitPLOC(rootIdx, (int)clusters.size() - 1, start, clusters, tris.data, nextNode);
+}
+
+// A triangle reference of the spatial split builder, bounds may be clipped to
+// a part of the triangle when it has been split across several nodes.
+struct Ref {
+    Box box;
+    int tri;
+};
+
+struct SpatialBin {
+    Box box;
+    int entries;
+    int exits;
+};
+
+struct SBVHContext {
+    std::atomic<int>* nextNode = nullptr;
+    std::atomic<int> refCount{0};
+    int maxRefs = 0;
+    float minOverlap = 0.0f;
+    std::mutex leafMutex;
+    std::vector<const int*> leaves; // node.count references each, in buildScratch
+};
+
+// Sutherland-Hodgman against one axis aligned plane, keeps the side where
+// sign * (p[axis] - pos) >= 0.
+static int clipPolygon(const vec3* in, int n, int axis, float pos, float sign, vec3* out) {
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        const vec3& a = in[i];
+        const vec3& b = in[(i + 1) % n];
+        float da = sign * (a[axis] - pos);
+        float db = sign * (b[axis] - pos);
+        if (da >= 0.0f) out[m++] = a;
+        if ((da >= 0.0f) != (db >= 0.0f)) {
+            vec3 p = a + (b - a) * (da / (da - db));
+            p[axis] = pos;
+            out[m++] = p;
+        }
+    }
+    return m;
+}
+
+// Bounds of the part of tri inside box, empty if they do not intersect.
+static Box clipTriangle(const Tri& tri, const Box& box) {
+    vec3 polyA[9] = { tri.v0, tri.v1, tri.v2 };
+    vec3 polyB[9];
+    int n = 3;
+    for (int a = 0; a < 3 && n > 0; a++) {
+        n = clipPolygon(polyA, n, a, box.min[a], 1.0f, polyB);
+        n = clipPolygon(polyB, n, a, box.max[a], -1.0f, polyA);
+    }
+    Box clipped;
+    for (int i = 0; i < n; i++) clipped.grow(polyA[i]);
+    if (n > 0) {
+        clipped.min = max(clipped.min, box.min);
+        clipped.max = min(clipped.max, box.max);
+    }
+    return clipped;
+}
 
-        if (aPos > bPos) std::swap(aPos, bPos);
-        active.erase(active.begin() + bPos);
-        active.erase(active.begin() + aPos);
-        active.push_back(pIdx);
+float clippedTriangleArea(const Tri& tri, const vec3& boxMin, const vec3& boxMax) {
+    vec3 polyA[9] = { tri.v0, tri.v1, tri.v2 };
+    vec3 polyB[9];
+    int n = 3;
+    for (int a = 0; a < 3 && n > 0; a++) {
+        n = clipPolygon(polyA, n, a, boxMin[a], 1.0f, polyB);
+        n = clipPolygon(polyB, n, a, boxMax[a], -1.0f, polyA);
     }
+    vec3 sum = vec3(0.0f);
+    for (int i = 1; i + 1 < n; i++) sum += cross(polyA[i] - polyA[0], polyA[i + 1] - polyA[0]);
+    return 0.5f * length(sum);
+}
 
-    int rootIdx = active[0];
+static bool isEmpty(const Box& box) {
+    return box.min.x > box.max.x || box.min.y > box.max.y || box.min.z > box.max.z;
+}
 
-    tlas = getOrdered(allEntries, rootIdx);
-}
\ No newline at end of file
+static float boxArea(const Box& box) {
+    return isEmpty(box) ? 0.0f : sahArea(box.min, box.max);
+}
+
+struct SBVHSplit {
+    float cost = FLT_MAX;
+    int axis = 0;
+    float pos = 0.0f;
+    bool spatial = false;
+    Box left;
+    Box right;
+    int leftCount = 0;
+    int rightCount = 0;
+};
+
+static void findObjectSplit(const std::vector<Ref>& refs, int binCount, SBVHSplit& best) {
+    Box cbox;
+    for (const Ref& ref : refs) cbox.grow((ref.box.min + ref.box.max) * 0.5f);
+    vec3 extent = cbox.max - cbox.min;
+
+    for (int a = 0; a < 3; a++) {
+        if (extent[a] <= 0.0f) continue;
+        Box bins[Config::maxSahBins];
+        int counts[Config::maxSahBins] = {};
+        float scale = binCount / extent[a];
+        for (const Ref& ref : refs) {
+            float c = (ref.box.min[a] + ref.box.max[a]) * 0.5f;
+            int b = clamp((int)((c - cbox.min[a]) * scale), 0, binCount - 1);
+            bins[b].grow(ref.box);
+            counts[b]++;
+        }
+
+        Box leftBoxes[Config::maxSahBins];
+        Box acc;
+        for (int b = 0; b < binCount - 1; b++) {
+            acc.grow(bins[b]);
+            leftBoxes[b] = acc;
+        }
+        Box right;
+        int rightCount = 0;
+        for (int b = binCount - 1; b > 0; b--) {
+            right.grow(bins[b]);
+            rightCount += counts[b];
+            int leftCount = (int)refs.size() - rightCount;
+            float cost = leftCount * boxArea(leftBoxes[b - 1]) + rightCount * boxArea(right);
+            if (cost < best.cost && leftCount > 0 && rightCount > 0) {
+                best.cost = cost;
+                best.axis = a;
+                best.pos = cbox.min[a] + extent[a] * b / binCount;
+                best.spatial = false;
+                best.left = leftBoxes[b - 1];
+                best.right = right;
+                best.leftCount = leftCount;
+                best.rightCount = rightCount;
+            }
+        }
+    }
+}
+
+static void findSpatialSplit(const std::vector<Ref>& refs, const Box& bounds, int binCount, SBVHSplit& best) {
+    vec3 extent = bounds.max - bounds.min;
+    for (int a = 0; a < 3; a++) {
+        if (extent[a] <= 0.0f) continue;
+        SpatialBin bins[Config::maxSahBins];
+        for (int b = 0; b < binCount; b++) bins[b].entries = bins[b].exits = 0;
+        float binSize = extent[a] / binCount;
+
+        for (const Ref& ref : refs) {
+            int first = clamp((int)((ref.box.min[a] - bounds.min[a]) / binSize), 0, binCount - 1);
+            int last = clamp((int)((ref.box.max[a] - bounds.min[a]) / binSize), first, binCount - 1);
+            for (int b = first; b <= last; b++) {
+                Box slab = ref.box;
+                slab.min[a] = std::max(slab.min[a], bounds.min[a] + binSize * b);
+                slab.max[a] = std::min(slab.max[a], b == binCount - 1 ? bounds.max[a] : bounds.min[a] + binSize * (b + 1));
+                bins[b].box.grow(first == last ? ref.box : clipTriangle(buildTri(ref.tri), slab));
+            }
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+
+        Box leftBoxes[Config::maxSahBins];
+        int leftCounts[Config::maxSahBins];
+        Box acc;
+        int count = 0;
+        for (int b = 0; b < binCount - 1; b++) {
+            acc.grow(bins[b].box);
+            count += bins[b].entries;
+            leftBoxes[b] = acc;
+            leftCounts[b] = count;
+        }
+        Box right;
+        int rightCount = 0;
+        for (int b = binCount - 1; b > 0; b--) {
+            right.grow(bins[b].box);
+            rightCount += bins[b].exits;
+            int leftCount = leftCounts[b - 1];
+            float cost = leftCount * boxArea(leftBoxes[b - 1]) + rightCount * boxArea(right);
+            if (cost < best.cost && leftCount > 0 && rightCount > 0) {
+                best.cost = cost;
+                best.axis = a;
+                best.pos = bounds.min[a] + binSize * b;
+                best.spatial = true;
+                best.left = leftBoxes[b - 1];
+                best.right = right;
+                best.leftCount = leftCount;
+                best.rightCount = rightCount;
+            }
+        }
+    }
+}
+
+// Distributes refs for a spatial split. Straddling references are either
+// duplicated with clipped bounds or, when the SAH prefers it, kept whole on
+// one side (reference unsplitting).
+static void splitSpatial(std::vector<Ref>& refs, const SBVHSplit& split, std::vector<Ref>& left, std::vector<Ref>& right) {
+    int a = split.axis;
+    Box lbox = split.left, rbox = split.right;
+    int lcount = split.leftCount, rcount = split.rightCount;
+    for (const Ref& ref : refs) {
+        if (ref.box.max[a] <= split.pos) {
+            left.push_back(ref);
+        } else if (ref.box.min[a] >= split.pos) {
+            right.push_back(ref);
+        } else {
+            Box lgrown = lbox, rgrown = rbox;
+            lgrown.grow(ref.box);
+            rgrown.grow(ref.box);
+            float splitCost = boxArea(lbox) * lcount + boxArea(rbox) * rcount;
+            float leftCost = boxArea(lgrown) * lcount + boxArea(rbox) * (rcount - 1);
+            float rightCost = boxArea(lbox) * (lcount - 1) + boxArea(rgrown) * rcount;
+            if (leftCost < splitCost && leftCost <= rightCost) {
+                left.push_back(ref);
+                lbox = lgrown;
+                rcount--;
+            } else if (rightCost < splitCost) {
+                right.push_back(ref);
+                rbox = rgrown;
+                lcount--;
+            } else {
+                Box lclip = ref.box, rclip = ref.box;
+                lclip.max[a] = split.pos;
+                rclip.min[a] = split.pos;
+                lclip = clipTriangle(buildTri(ref.tri), lclip);
+                rclip = clipTriangle(buildTri(ref.tri), rclip);
+                if (!isEmpty(lclip)) left.push_back({ lclip, ref.tri });
+                if (!isEmpty(rclip)) right.push_back({ rclip, ref.tri });
+            }
+        }
+    }
+}
+
+static void splitObject(std::vector<Ref>& refs, const SBVHSplit& split, std::vector<Ref>& left, std::vector<Ref>& right) {
+    for (const Ref& ref : refs) {
+        float c = (ref.box.min[split.axis] + ref.box.max[split.axis]) * 0.5f;
+        if (c < split.pos) left.push_back(ref);
+        else right.push_back(ref);
+    }
+}
+
+// Object median of the reference centroids along their widest axis. Both
+// halves hold count / 2 or more references, as in splitMedian.
+static void splitMedianRefs(std::vector<Ref>& refs, std::vector<Ref>& left, std::vector<Ref>& right) {
+    Box cbox;
+    for (const Ref& ref : refs) cbox.grow((ref.box.min + ref.box.max) * 0.5f);
+    vec3 extent = cbox.max - cbox.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    size_t half = refs.size() / 2;
+    if (extent[axis] > 0.0f) {
+        std::nth_element(refs.begin(), refs.begin() + half, refs.end(), [axis](const Ref& a, const Ref& b) {
+            return a.box.min[axis] + a.box.max[axis] < b.box.min[axis] + b.box.max[axis];
+        });
+    }
+    left.assign(refs.begin(), refs.begin() + half);
+    right.assign(refs.begin() + half, refs.end());
+}
+
+static void subdivideSBVH(int idx, std::vector<Ref> refs, SBVHContext& ctx, int depth) {
+    Node& node = nodes[idx];
+    Box bounds;
+    for (const Ref& ref : refs) bounds.grow(ref.box);
+    node.min = bounds.min;
+    node.max = bounds.max;
+
+    int count = (int)refs.size();
+    int binCount = clamp(bvhSettings.bins, 2, Config::maxSahBins);
+    SBVHSplit split;
+    if (count > Config::minVolumeAmount && depth < Config::maxBVHDepth) {
+        findObjectSplit(refs, binCount, split);
+        Box overlap;
+        overlap.min = max(split.left.min, split.right.min);
+        overlap.max = min(split.left.max, split.right.max);
+        if (split.cost == FLT_MAX || (!isEmpty(overlap) && area(overlap.min, overlap.max) > ctx.minOverlap)) {
+            findSpatialSplit(refs, bounds, binCount, split);
+        }
+    }
+
+    float boundsArea = sahArea(bounds.min, bounds.max);
+    bool cheaper = split.cost < FLT_MAX && splitCost(boundsArea, split.cost) < leafCost(boundsArea, count);
+    if (count <= Config::minVolumeAmount || (!cheaper && count <= bvhSettings.maxLeafSize)) {
+        int* leaf = buildScratch.alloc<int>(count);
+        for (int i = 0; i < count; i++) leaf[i] = refs[i].tri;
+        std::lock_guard<std::mutex> lock(ctx.leafMutex);
+        node.start = (int)ctx.leaves.size();
+        node.count = count;
+        ctx.leaves.push_back(leaf);
+        return;
+    }
+
+    std::vector<Ref> left, right;
+    if (split.cost == FLT_MAX) {
+        // past maxBVHDepth or without any valid split, halve at the object
+        // median like splitNode so oversized leaves still get split
+        splitMedianRefs(refs, left, right);
+    } else if (split.spatial) {
+        int extra = split.leftCount + split.rightCount - count;
+        if (ctx.refCount.fetch_add(extra) + extra <= ctx.maxRefs) {
+            splitSpatial(refs, split, left, right);
+            ctx.refCount -= extra - ((int)left.size() + (int)right.size() - count);
+        } else {
+            ctx.refCount -= extra;
+            split = SBVHSplit();
+            findObjectSplit(refs, binCount, split);
+            if (split.cost == FLT_MAX) split.pos = FLT_MAX;
+            splitObject(refs, split, left, right);
+        }
+    } else {
+        splitObject(refs, split, left, right);
+    }
+    if (left.empty() || right.empty()) {
+        // coincident centroids, fall back to halving the reference list
+        left.clear();
+        right.clear();
+        left.assign(refs.begin(), refs.begin() + count / 2);
+        right.assign(refs.begin() + count / 2, refs.end());
+    }
+    refs.clear();
+    refs.shrink_to_fit();
+
+    int leftChildIdx = ctx.nextNode->fetch_add(2);
+    int rightChildIdx = leftChildIdx + 1;
+    node.start = leftChildIdx;
+    node.count = 0;
+
+    if (bvhSettings.parallel && count >= Config::parallelTaskMin) {
+        TaskGroup group;
+        threadPool().submit(group, [=, &ctx, left = std::move(left)]() mutable {
+            subdivideSBVH( leftChildIdx, std::move(left), ctx, depth + 1 );
+        });
+        subdivideSBVH( rightChildIdx, std::move(right), ctx, depth + 1 );
+        threadPool().wait(group);
+    } else {
+        subdivideSBVH( leftChildIdx, std::move(left), ctx, depth + 1 );
+        subdivideSBVH( rightChildIdx, std::move(right), ctx, depth + 1 );
+    }
+}
+
+// Spatial split BVH (Stich et al.): object splits compete with binned spatial
+// splits that clip straddling triangles into both children. Duplicated
+// references are bounded by sbvhBudget times the triangle count. Leaves are
+// written to triIndices in depth first order starting at the root range, which
+// must have room for maxRefs. Returns the number of references written.
+int buildSBVH(int rootIdx, int maxRefs, std::atomic<int>& nextNode) {
+    int start = nodes[rootIdx].start;
+    int count = nodes[rootIdx].count;
+
+    SBVHContext ctx;
+    ctx.nextNode = &nextNode;
+    ctx.refCount = count;
+    ctx.maxRefs = maxRefs;
+
+    std::vector<Ref> refs(count);
+    for (int i = 0; i < count; i++) {
+        int tri = triIndices[start + i];
+        refs[i].box.min = buildTri(tri).min;
+        refs[i].box.max = buildTri(tri).max;
+        refs[i].tri = tri;
+    }
+    Box bounds;
+    for (const Ref& ref : refs) bounds.grow(ref.box);
+    ctx.minOverlap = Config::sbvhAlpha * area(bounds.min, bounds.max);
+
+    subdivideSBVH(rootIdx, std::move(refs), ctx, 0);
+
+    int offset = start;
+    std::vector<int> stack = { rootIdx };
+    while (!stack.empty()) {
+        Node& node = nodes[stack.back()];
+        stack.pop_back();
+        if (node.count == 0) {
+            stack.push_back(node.start + 1);
+            stack.push_back(node.start);
+            continue;
+        }
+        const int* leaf = ctx.leaves[node.start];
+        std::copy(leaf, leaf + node.count, triIndices.begin() + offset);
+        node.start = offset;
+        offset += node.count;
+    }
+    return offset - start;
+}
+
+// Early split clipping: before the build, the triangles whose boxes waste the
+// most area are cut into pieces along a power-of-two grid over the mesh
+// bounds, with the splits handed out in proportion to that waste. Every piece
+// is a copy of its triangle carrying the bounds and centroid of its clipped
+// part, so the builders work on pieces unchanged. Each piece becomes one
+// reference to its triangle, like the duplicates of a spatial split.
+static float presplitPriority(const Tri& tri) {
+    float triArea = 0.5f * length(cross(tri.v1 - tri.v0, tri.v2 - tri.v0));
+    return std::cbrt(std::max(0.0f, area(tri.min, tri.max) - 2.0f * triArea));
+}
+
+// Coarsest grid plane over bounds that crosses the longest axis of box.
+static float presplitPlane(const Box& box, const Box& bounds, int& axis) {
+    vec3 e = box.max - box.min;
+    axis = e.x > e.y ? (e.x > e.z ? 0 : 2) : (e.y > e.z ? 1 : 2);
+    float lo = box.min[axis];
+    float hi = box.max[axis];
+    float origin = bounds.min[axis];
+    float extent = bounds.max[axis] - origin;
+    for (int level = 1; level < 24; level++) {
+        float cell = extent / float(1 << level);
+        float pos = origin + (std::floor((lo - origin) / cell) + 1.0f) * cell;
+        if (pos > lo && pos < hi) return pos;
+    }
+    return 0.5f * (lo + hi);
+}
+
+static void splitPieces(const Tri& tri, const Box& box, int pieces, const Box& bounds, std::vector<Box>& out) {
+    if (pieces <= 1) {
+        out.push_back(box);
+        return;
+    }
+    int axis;
+    float pos = presplitPlane(box, bounds, axis);
+    Box leftBox = box;
+    Box rightBox = box;
+    leftBox.max[axis] = pos;
+    rightBox.min[axis] = pos;
+    Box left = clipTriangle(tri, leftBox);
+    Box right = clipTriangle(tri, rightBox);
+    if (isEmpty(left) || isEmpty(right)) {
+        out.push_back(box);
+        return;
+    }
+    splitPieces(tri, left, pieces / 2, bounds, out);
+    splitPieces(tri, right, pieces - pieces / 2, bounds, out);
+}
+
+// Scale that hands out at most budget splits as scale * priority, rounded down.
+static float presplitScale(const std::vector<float>& priority, int budget) {
+    float total = 0.0f;
+    for (float p : priority) total += p;
+    if (total <= 0.0f) return 0.0f;
+
+    float lo = budget / total;
+    float hi = (budget + (int)priority.size()) / total;
+    for (int iter = 0; iter < 20; iter++) {
+        float mid = 0.5f * (lo + hi);
+        long used = 0;
+        for (float p : priority) used += (long)(mid * p);
+        if (used <= budget) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Pieces of the batch being built and the triangle each was cut from.
+static std::vector<Tri> pieces;
+static std::vector<int> pieceSource;
+
+// Cuts the triangles of a batch of meshes into pieces, the ones of batch[m]
+// going from firstPiece[m] up to firstPiece[m + 1].
+static void presplitTriangles(const Mesh* batch, int count, std::vector<int>& firstPiece) {
+    pieces.clear();
+    pieceSource.clear();
+    firstPiece.assign(count + 1, 0);
+    std::vector<float> priority;
+    std::vector<Box> boxes;
+    for (int m = 0; m < count; m++) {
+        const Mesh& mesh = batch[m];
+        const Tri* tris = triangles.data() + mesh.triStart;
+        firstPiece[m] = (int)pieces.size();
+        Box bounds;
+        priority.resize(mesh.triCount);
+        for (int i = 0; i < mesh.triCount; i++) {
+            bounds.grow(tris[i].min);
+            bounds.grow(tris[i].max);
+            priority[i] = presplitPriority(tris[i]);
+        }
+        float scale = presplitScale(priority, (int)(mesh.triCount * bvhSettings.presplitBudget));
+
+        for (int i = 0; i < mesh.triCount; i++) {
+            Box box;
+            box.min = tris[i].min;
+            box.max = tris[i].max;
+            boxes.clear();
+            splitPieces(tris[i], box, (int)(scale * priority[i]) + 1, bounds, boxes);
+            for (const Box& piece : boxes) {
+                Tri tri = tris[i];
+                if (boxes.size() > 1) {
+                    tri.min = piece.min;
+                    tri.max = piece.max;
+                    tri.c = 0.5f * (piece.min + piece.max);
+                }
+                pieces.push_back(tri);
+                pieceSource.push_back(mesh.triStart + i);
+            }
+        }
+    }
+    firstPiece[count] = (int)pieces.size();
+}
+
+static std::unordered_map<int, float> buildCosts; // refittedSAH() right after the last build, keyed by root
+
+static Box refittedBounds(int idx, float& cost) {
+    const Node& node = nodes[idx];
+    Box box;
+    if (node.count > 0) {
+        box = triBounds(node.start, node.start + node.count);
+        cost += leafCost(area(box.min, box.max), node.count);
+    } else {
+        box = refittedBounds(node.start, cost);
+        box.grow(refittedBounds(node.start + 1, cost));
+        cost += bvhSettings.traversalCost * area(box.min, box.max);
+    }
+    return box;
+}
+
+// SAH cost the tree of mesh has after a refitBVH() that moved nothing. Leaves
+// clipped by SBVH or presplit builds grow back to whole triangles in a refit,
+// so refits compare against this rather than computeSAH() of the fresh tree.
+static float refittedSAH(const Mesh& mesh) {
+    float cost = 0.0f;
+    Box root = refittedBounds(mesh.bvhRoot, cost);
+    float rootArea = area(root.min, root.max);
+    return rootArea > 0.0f ? cost / rootArea : 0.0f;
+}
+
+// Slots a mesh owns once it has been edited with insertTriangle() or
+// removeTriangle(). Both ranges carry spare room so most edits need no move.
+struct DynamicRanges {
+    int refStart;
+    int refEnd;
+    int triEnd; // triangle slots from triStart + triCount up to here are spare
+    std::vector<int> freeRefs;
+};
+static std::unordered_map<int, DynamicRanges> dynamicRanges; // keyed by root
+static std::vector<int> freePairs; // child pairs released by removeTriangle()
+static BVHEdits edits; // since the last takeBVHEdits()
+
+static void edited(EditedEntries& entries, int idx) {
+    if (!entries.all) entries.indices.push_back(idx);
+}
+
+// Builds the tree below idx over the references in its triIndices range, which
+// has room for maxRefs entries, taking child pairs from nextNode. Returns the
+// number of references in use.
+static int buildTree(int idx, int maxRefs, std::atomic<int>& nextNode) {
+    int refCount = nodes[idx].count;
+    switch (bvhSettings.builder) {
+        case BVHBuilder::LBVH:
+            buildLBVH( idx, nextNode );
+            break;
+        case BVHBuilder::PLOC:
+            buildPLOC( idx, nextNode );
+            break;
+        case BVHBuilder::SBVH:
+            refCount = buildSBVH( idx, maxRefs, nextNode );
+            break;
+        default:
+            shrinkBounds( idx );
+            subdivide( idx, 0, nextNode );
+            break;
+    }
+    return refCount;
+}
+
+// Puts the next root on an odd index, so the child pairs allocated after it
+// start on even ones and each pair fills exactly one 64-byte line.
+static void alignNextRoot() {
+    if (usedNodes % 2 == 0) usedNodes++;
+}
+
+// Room for the references of mesh when its build starts from refCount of them.
+static int maxRefsOf(const Mesh& mesh, int refCount) {
+    int maxRefs = refCount;
+    if (bvhSettings.builder == BVHBuilder::SBVH) maxRefs += (int)(mesh.triCount * bvhSettings.sbvhBudget);
+    return maxRefs;
+}
+
+// Most nodes a tree over maxRefs references takes, plus the slot alignNextRoot() may skip.
+static int maxNodesOf(int maxRefs) {
+    return maxRefs * 2;
+}
+
+// Node storage and scratch memory of a batch of builds. The constructor grows
+// nodes once to the worst case of every tree in the batch, so building mesh
+// after mesh never reallocates and copies the nodes built before it. When the
+// outermost scope ends, nodes is trimmed to usedNodes and every temporary the
+// builds took from buildScratch is released at once.
+class BuildScope {
+public:
+    explicit BuildScope(int maxNodes) {
+        depth++;
+        int needed = usedNodes + maxNodes;
+        if ((int)nodes.size() < needed) nodes.resize(needed);
+    }
+    ~BuildScope() {
+        if (--depth > 0) return;
+        nodes.resize(usedNodes);
+        buildScratch.release();
+    }
+    BuildScope(const BuildScope&) = delete;
+    BuildScope& operator=(const BuildScope&) = delete;
+
+private:
+    static int depth;
+};
+
+int BuildScope::depth = 0;
+
+int appendBVH(const Node* src, int count, int refOffset) {
+    alignNextRoot();
+    int base = usedNodes;
+    nodes.resize(base + count);
+    for (int i = 0; i < count; i++) {
+        Node node = src[i];
+        node.start += node.count > 0 ? refOffset : base;
+        nodes[base + i] = node;
+    }
+    usedNodes += count;
+    return base;
+}
+
+// Pre-order list of the nodes below root, parents always come before their children.
+static void collectNodes(int root, std::vector<int>& order) {
+    order.clear();
+    std::vector<int> stack = { root };
+    while (!stack.empty()) {
+        int idx = stack.back();
+        stack.pop_back();
+        order.push_back(idx);
+        if (nodes[idx].count == 0) {
+            stack.push_back(nodes[idx].start + 1);
+            stack.push_back(nodes[idx].start);
+        }
+    }
+}
+
+void rebuildBVH(Mesh& mesh) {
+    dynamicRanges.erase(mesh.bvhRoot);
+    edits.nodes.all = true;
+    edits.triIndices.all = true;
+    std::vector<int> order;
+    collectNodes(mesh.bvhRoot, order);
+
+    std::vector<int> pairs;
+    int refStart = INT_MAX;
+    int refEnd = 0;
+    for (int idx : order) {
+        const Node& node = nodes[idx];
+        if (node.count == 0) {
+            pairs.push_back(node.start);
+        } else {
+            refStart = std::min(refStart, node.start);
+            refEnd = std::max(refEnd, node.start + node.count);
+        }
+    }
+    int refCount = mesh.triCount;
+    int first = mesh.triStart;
+    std::vector<int> firstPiece;
+    if (bvhSettings.presplit) {
+        presplitTriangles(&mesh, 1, firstPiece);
+        refCount = firstPiece[1];
+        first = 0;
+    }
+    if (refCount > refEnd - refStart) {
+        // more pieces than the old references, take a new range at the end
+        refStart = (int)triIndices.size();
+        refEnd = refStart + maxRefsOf(mesh, refCount);
+        triIndices.resize(refEnd, mesh.triStart);
+    }
+    for (int i = 0; i < refCount; i++) triIndices[refStart + i] = first + i;
+
+    // build behind the used nodes, then move the new tree into the old slots
+    int maxRefs = refEnd - refStart;
+    BuildScope scope(maxNodesOf(maxRefs));
+    int end = usedNodes;
+    alignNextRoot();
+    int base = usedNodes;
+    int idx = usedNodes++;
+    nodes[idx].start = refStart;
+    nodes[idx].count = refCount;
+    if (bvhSettings.presplit) buildTris = &pieces;
+    refCount = buildTree( idx, maxRefs, usedNodes );
+    if (bvhSettings.presplit) {
+        buildTris = &triangles;
+        for (int i = refStart; i < refStart + refCount; i++) triIndices[i] = pieceSource[triIndices[i]];
+        std::vector<Tri>().swap(pieces);
+        std::vector<int>().swap(pieceSource);
+    }
+
+    // the old pairs take the first new pairs, then released ones; any beyond
+    // them are packed from the first even slot after end, which never lies
+    // past their build slot, and old pairs left over go to freePairs
+    int newPairs = (usedNodes - base - 1) / 2;
+    while ((int)pairs.size() < newPairs && !freePairs.empty()) {
+        pairs.push_back(freePairs.back());
+        freePairs.pop_back();
+    }
+    int oldPairs = (int)pairs.size();
+    int extra = (end + 1) & ~1;
+    auto slot = [&](int n) {
+        if (n == base) return mesh.bvhRoot;
+        int pair = (n - base - 1) / 2;
+        int side = (n - base - 1) % 2;
+        return (pair < oldPairs ? pairs[pair] : extra + 2 * (pair - oldPairs)) + side;
+    };
+    for (int n = base; n < usedNodes; n++) {
+        Node node = nodes[n];
+        if (node.count == 0) node.start = slot(node.start);
+        nodes[slot(n)] = node;
+    }
+    usedNodes = newPairs > oldPairs ? extra + 2 * (newPairs - oldPairs) : end;
+    for (int k = newPairs; k < oldPairs; k++) freePairs.push_back(pairs[k]);
+    buildCosts[mesh.bvhRoot] = refittedSAH(mesh);
+    checkBVH(mesh);
+}
+
+bool refitBVH(Mesh& mesh) {
+    if (mesh.bvhRoot < 0) return false;
+
+    std::vector<int> order;
+    collectNodes(mesh.bvhRoot, order);
+    if (buildCosts.find(mesh.bvhRoot) == buildCosts.end()) buildCosts[mesh.bvhRoot] = refittedSAH(mesh);
+
+    parallelFor(0, (int)order.size(), Config::parallelGrain, [&](int lo, int hi) {
+        for (int k = lo; k < hi; k++) {
+            Node& node = nodes[order[k]];
+            if (node.count == 0) continue;
+            Box box = triBounds(node.start, node.start + node.count);
+            node.min = box.min;
+            node.max = box.max;
+        }
+    });
+    for (int k = (int)order.size() - 1; k >= 0; k--) {
+        Node& node = nodes[order[k]];
+        if (node.count > 0) continue;
+        node.min = min(nodes[node.start].min, nodes[node.start + 1].min);
+        node.max = max(nodes[node.start].max, nodes[node.start + 1].max);
+    }
+
+    if (computeSAH(mesh) > buildCosts[mesh.bvhRoot] * bvhSettings.refitRebuildRatio) {
+        rebuildBVH(mesh);
+        return true;
+    }
+    checkBVH(mesh);
+    return false;
+}
+
+// Incremental updates: insertTriangle() places a one-triangle leaf next to
+// the node that grows the SAH cost least (branch and bound over the inherited
+// cost of enlarging the ancestors, as in Bittner's and Box2D's dynamic trees),
+// then refits and rotates the nodes on the way back up. removeTriangle()
+// drops the triangle's references and promotes the sibling of every leaf that
+// runs empty into its parent.
+
+static bool overlaps(const vec3& minA, const vec3& maxA, const vec3& minB, const vec3& maxB) {
+    return minA.x <= maxB.x && minA.y <= maxB.y && minA.z <= maxB.z &&
+           minB.x <= maxA.x && minB.y <= maxA.y && minB.z <= maxA.z;
+}
+
+static DynamicRanges& dynamicRangesOf(const Mesh& mesh) {
+    auto it = dynamicRanges.find(mesh.bvhRoot);
+    if (it != dynamicRanges.end()) return it->second;
+
+    DynamicRanges ranges;
+    ranges.refStart = INT_MAX;
+    ranges.refEnd = 0;
+    ranges.triEnd = mesh.triStart + mesh.triCount;
+    std::vector<int> order;
+    collectNodes(mesh.bvhRoot, order);
+    for (int idx : order) {
+        if (nodes[idx].count == 0) continue;
+        ranges.refStart = std::min(ranges.refStart, nodes[idx].start);
+        ranges.refEnd = std::max(ranges.refEnd, nodes[idx].start + nodes[idx].count);
+    }
+    return dynamicRanges[mesh.bvhRoot] = ranges;
+}
+
+static int allocPair() {
+    if (!freePairs.empty()) {
+        int pair = freePairs.back();
+        freePairs.pop_back();
+        return pair;
+    }
+    if (usedNodes % 2) usedNodes++;
+    int pair = usedNodes.fetch_add(2);
+    nodes.resize(usedNodes);
+    edits.nodes.all = true;
+    return pair;
+}
+
+// Moves the mesh's triangles to the end of triangles with as much spare room
+// again as half their count, and points its references at the new slots.
+static void moveTriangles(Mesh& mesh, DynamicRanges& ranges) {
+    int start = (int)triangles.size();
+    int spare = mesh.triCount / 2 + 1;
+    Tri filler = triangles[mesh.triStart];
+    triangles.resize(start + mesh.triCount + spare, filler);
+    std::copy(triangles.begin() + mesh.triStart, triangles.begin() + mesh.triStart + mesh.triCount, triangles.begin() + start);
+    for (int i = ranges.refStart; i < ranges.refEnd; i++) triIndices[i] += start - mesh.triStart;
+    mesh.triStart = start;
+    edits.triangles.all = true;
+    edits.triIndices.all = true;
+    ranges.triEnd = start + mesh.triCount + spare;
+}
+
+// Same for the reference range, whose leaves are shifted along with it.
+static void moveRefs(const Mesh& mesh, DynamicRanges& ranges) {
+    int start = (int)triIndices.size();
+    int count = ranges.refEnd - ranges.refStart;
+    int spare = count / 2 + 1;
+    int shift = start - ranges.refStart;
+    triIndices.resize(start + count + spare, mesh.triStart);
+    std::copy(triIndices.begin() + ranges.refStart, triIndices.begin() + ranges.refEnd, triIndices.begin() + start);
+
+    std::vector<int> order;
+    collectNodes(mesh.bvhRoot, order);
+    for (int idx : order) {
+        if (nodes[idx].count > 0) nodes[idx].start += shift;
+    }
+    for (int& ref : ranges.freeRefs) ref += shift;
+    for (int i = start + count; i < start + count + spare; i++) ranges.freeRefs.push_back(i);
+    ranges.refStart = start;
+    ranges.refEnd = start + count + spare;
+    edits.nodes.all = true;
+    edits.triIndices.all = true;
+}
+
+static int allocRef(const Mesh& mesh, DynamicRanges& ranges) {
+    if (ranges.freeRefs.empty()) {
+        if (ranges.refEnd == (int)triIndices.size()) {
+            triIndices.push_back(mesh.triStart);
+            edits.triIndices.all = true;
+            return ranges.refEnd++;
+        }
+        moveRefs(mesh, ranges);
+    }
+    int ref = ranges.freeRefs.back();
+    ranges.freeRefs.pop_back();
+    return ref;
+}
+
+static void refitInner(int idx) {
+    Node& node = nodes[idx];
+    node.min = min(nodes[node.start].min, nodes[node.start + 1].min);
+    node.max = max(nodes[node.start].max, nodes[node.start + 1].max);
+    edited(edits.nodes, idx);
+}
+
+// Swaps one child of idx with a grandchild below its sibling when that
+// shrinks the sibling (Kopta et al.). Subtrees move along with their node.
+static void rotateNode(int idx) {
+    int left = nodes[idx].start;
+    float bestGain = 0.0f;
+    int swapA = -1;
+    int swapB = -1;
+    for (int side = 0; side < 2; side++) {
+        int child = left + side;
+        int sibling = left + 1 - side;
+        const Node& sib = nodes[sibling];
+        if (sib.count > 0) continue;
+        float sibArea = area(sib.min, sib.max);
+        for (int k = 0; k < 2; k++) {
+            const Node& kept = nodes[sib.start + 1 - k];
+            float gain = sibArea - area(min(nodes[child].min, kept.min), max(nodes[child].max, kept.max));
+            if (gain > bestGain) {
+                bestGain = gain;
+                swapA = child;
+                swapB = sib.start + k;
+            }
+        }
+    }
+    if (swapA < 0) return;
+    std::swap(nodes[swapA], nodes[swapB]);
+    edited(edits.nodes, swapA);
+    edited(edits.nodes, swapB);
+    refitInner(left + (swapA == left ? 1 : 0));
+}
+
+int insertTriangle(Mesh& mesh, const Tri& tri) {
+    if (mesh.bvhRoot < 0) return -1;
+    DynamicRanges& ranges = dynamicRangesOf(mesh);
+
+    if (mesh.triStart + mesh.triCount == ranges.triEnd) {
+        if (ranges.triEnd == (int)triangles.size()) {
+            triangles.push_back(tri);
+            ranges.triEnd++;
+            edits.triangles.all = true;
+        } else {
+            moveTriangles(mesh, ranges);
+        }
+    }
+    int triIdx = mesh.triStart + mesh.triCount++;
+    triangles[triIdx] = tri;
+    int ref = allocRef(mesh, ranges);
+    triIndices[ref] = triIdx;
+    edited(edits.triangles, triIdx);
+    edited(edits.triIndices, ref);
+    edits.meshes.all = true;
+
+    struct Candidate {
+        int node;
+        int parent; // position in candidates
+        float inherited;
+    };
+    std::vector<Candidate> candidates = { { mesh.bvhRoot, -1, 0.0f } };
+    std::vector<int> stack = { 0 };
+    float leafArea = area(tri.min, tri.max);
+    float bestCost = FLT_MAX;
+    int best = 0;
+    while (!stack.empty()) {
+        Candidate c = candidates[stack.back()];
+        int pos = stack.back();
+        stack.pop_back();
+        const Node& node = nodes[c.node];
+        float direct = area(min(node.min, tri.min), max(node.max, tri.max));
+        if (direct + c.inherited < bestCost) {
+            bestCost = direct + c.inherited;
+            best = pos;
+        }
+        float inherited = c.inherited + direct - area(node.min, node.max);
+        if (node.count == 0 && leafArea + inherited < bestCost) {
+            for (int k = 0; k < 2; k++) {
+                candidates.push_back({ node.start + k, pos, inherited });
+                stack.push_back((int)candidates.size() - 1);
+            }
+        }
+    }
+    std::vector<int> path;
+    for (int pos = best; pos >= 0; pos = candidates[pos].parent) path.push_back(candidates[pos].node);
+
+    // the sibling keeps its slot as the new parent, so its own parent needs no update
+    int sibling = path.front();
+    int pair = allocPair();
+    nodes[pair] = nodes[sibling];
+    nodes[pair + 1] = { tri.min, tri.max, ref, 1 };
+    nodes[sibling].start = pair;
+    nodes[sibling].count = 0;
+    edited(edits.nodes, pair);
+    edited(edits.nodes, pair + 1);
+    for (int idx : path) {
+        refitInner(idx);
+        rotateNode(idx);
+    }
+
+    if ((int)path.size() >= Config::maxBVHDepth) rebuildBVH(mesh);
+    else checkBVH(mesh);
+    return triIdx;
+}
+
+enum class DropResult { Unchanged, Changed, Emptied };
+
+// Removes every reference to tri below idx, box being tri's bounds.
+static DropResult dropReferences(int idx, int tri, const Tri& bounds, DynamicRanges& ranges) {
+    Node& node = nodes[idx];
+    if (!overlaps(node.min, node.max, bounds.min, bounds.max)) return DropResult::Unchanged;
+
+    if (node.count > 0) {
+        bool found = false;
+        for (int i = node.start; i < node.start + node.count; i++) {
+            if (triIndices[i] != tri) continue;
+            int last = node.start + --node.count;
+            edited(edits.triIndices, i);
+            triIndices[i--] = triIndices[last];
+            ranges.freeRefs.push_back(last);
+            found = true;
+        }
+        if (!found) return DropResult::Unchanged;
+        edited(edits.nodes, idx);
+        if (node.count == 0) return DropResult::Emptied;
+        Box box = triBounds(node.start, node.start + node.count);
+        node.min = box.min;
+        node.max = box.max;
+        return DropResult::Changed;
+    }
+
+    int left = node.start;
+    DropResult l = dropReferences(left, tri, bounds, ranges);
+    DropResult r = dropReferences(left + 1, tri, bounds, ranges);
+    if (l == DropResult::Unchanged && r == DropResult::Unchanged) return DropResult::Unchanged;
+    if (l == DropResult::Emptied || r == DropResult::Emptied) {
+        freePairs.push_back(left);
+        if (l == r) return DropResult::Emptied;
+        nodes[idx] = nodes[l == DropResult::Emptied ? left + 1 : left];
+        edited(edits.nodes, idx);
+        return DropResult::Changed;
+    }
+    refitInner(idx);
+    return DropResult::Changed;
+}
+
+static void retargetReferences(int idx, int from, int to, const Tri& bounds) {
+    const Node& node = nodes[idx];
+    if (!overlaps(node.min, node.max, bounds.min, bounds.max)) return;
+    if (node.count > 0) {
+        for (int i = node.start; i < node.start + node.count; i++) {
+            if (triIndices[i] != from) continue;
+            triIndices[i] = to;
+            edited(edits.triIndices, i);
+        }
+        return;
+    }
+    retargetReferences(node.start, from, to, bounds);
+    retargetReferences(node.start + 1, from, to, bounds);
+}
+
+bool removeTriangle(Mesh& mesh, int triIdx) {
+    if (mesh.bvhRoot < 0 || mesh.triCount <= 1) return false;
+    if (triIdx < mesh.triStart || triIdx >= mesh.triStart + mesh.triCount) return false;
+    DynamicRanges& ranges = dynamicRangesOf(mesh);
+
+    dropReferences(mesh.bvhRoot, triIdx, triangles[triIdx], ranges);
+    int last = mesh.triStart + --mesh.triCount;
+    if (last != triIdx) {
+        triangles[triIdx] = triangles[last];
+        edited(edits.triangles, triIdx);
+        retargetReferences(mesh.bvhRoot, last, triIdx, triangles[triIdx]);
+    }
+    edits.meshes.all = true;
+    checkBVH(mesh);
+    return true;
+}
+
+// Packs the leaf references of an edited mesh to the front of its range, so
+// the free slots no longer sit between leaves.
+static void packReferences(const Mesh& mesh, const DynamicRanges& ranges) {
+    std::vector<int> order;
+    collectNodes(mesh.bvhRoot, order);
+    std::vector<int> refs;
+    for (int idx : order) {
+        Node& node = nodes[idx];
+        if (node.count == 0) continue;
+        int start = ranges.refStart + (int)refs.size();
+        refs.insert(refs.end(), triIndices.begin() + node.start, triIndices.begin() + node.start + node.count);
+        node.start = start;
+    }
+    std::copy(refs.begin(), refs.end(), triIndices.begin() + ranges.refStart);
+    std::fill(triIndices.begin() + ranges.refStart + refs.size(), triIndices.begin() + ranges.refEnd, mesh.triStart);
+}
+
+// Every triIndices slot belongs to exactly one mesh's reference range, so laying
+// the triangles out in triIndices order gives each leaf its own contiguous run.
+void reorderTriangles() {
+    for (const Mesh& mesh : meshes) {
+        auto it = dynamicRanges.find(mesh.bvhRoot);
+        if (it != dynamicRanges.end()) packReferences(mesh, it->second);
+    }
+    dynamicRanges.clear();
+
+    std::vector<Tri> ordered(triIndices.size());
+    parallelFor(0, (int)triIndices.size(), Config::parallelGrain, [&](int lo, int hi) {
+        for (int i = lo; i < hi; i++) ordered[i] = triangles[triIndices[i]];
+    });
+
+    for (Mesh& mesh : meshes) {
+        if (mesh.bvhRoot < 0) continue;
+        std::vector<int> order;
+        collectNodes(mesh.bvhRoot, order);
+        int refStart = INT_MAX;
+        int refEnd = 0;
+        for (int idx : order) {
+            const Node& node = nodes[idx];
+            if (node.count == 0) continue;
+            refStart = std::min(refStart, node.start);
+            refEnd = std::max(refEnd, node.start + node.count);
+        }
+        mesh.triStart = refStart;
+        mesh.triCount = refEnd - refStart;
+    }
+
+    triangles.swap(ordered);
+    for (int i = 0; i < (int)triIndices.size(); i++) triIndices[i] = i;
+    for (const Mesh& mesh : meshes) checkBVH(mesh);
+}
+
+// One tree of a batch: the node range reserved for it starts at root and its
+// child pairs come from nextNode, so trees built at the same time never share
+// a node range.
+struct BatchBuild {
+    int root;
+    int refStart;
+    int maxRefs;
+    int refCount;
+    std::atomic<int> nextNode{0};
+};
+
+// Builds every mesh of the batch as its own task, with neighbouring small
+// meshes grouped until a task holds parallelGrain triangles. Large meshes get
+// a task of their own and fork further inside their builder. Each tree is
+// built in a worst case node and reference range, and the ranges are packed
+// behind each other afterwards, so the batch ends up laid out like a serial build.
+// Every tree gets its own range of triangle references, so builders that
+// duplicate references never overlap the ranges of other meshes.
+static void buildBatch(std::vector<Mesh>& meshes) {
+    int count = (int)meshes.size();
+    std::vector<int> firstPiece;
+    if (bvhSettings.presplit) presplitTriangles(meshes.data(), count, firstPiece);
+    auto refsOf = [&](int m) {
+        return bvhSettings.presplit ? firstPiece[m + 1] - firstPiece[m] : meshes[m].triCount;
+    };
+
+    int maxNodes = 0;
+    int maxRefs = 0;
+    for (int m = 0; m < count; m++) {
+        maxNodes += maxNodesOf(maxRefsOf(meshes[m], refsOf(m)));
+        maxRefs += maxRefsOf(meshes[m], refsOf(m));
+    }
+    BuildScope scope(maxNodes);
+
+    std::vector<BatchBuild> builds(count);
+    int nodeBase = usedNodes;
+    int refBase = (int)triIndices.size();
+    triIndices.resize(refBase + maxRefs);
+    int nodeCursor = nodeBase;
+    int refCursor = refBase;
+    for (int m = 0; m < count; m++) {
+        const Mesh& mesh = meshes[m];
+        BatchBuild& build = builds[m];
+        if (nodeCursor % 2 == 0) nodeCursor++;
+        build.root = nodeCursor;
+        build.refStart = refCursor;
+        build.maxRefs = maxRefsOf(mesh, refsOf(m));
+        build.nextNode = build.root + 1;
+        nodeCursor += build.maxRefs * 2 - 1;
+        refCursor += build.maxRefs;
+
+        int first = bvhSettings.presplit ? firstPiece[m] : mesh.triStart;
+        for (int i = 0; i < refsOf(m); i++) triIndices[build.refStart + i] = first + i;
+        nodes[build.root].start = build.refStart;
+        nodes[build.root].count = refsOf(m);
+    }
+    if (bvhSettings.presplit) buildTris = &pieces;
+
+    auto buildRange = [&builds](int first, int last) {
+        for (int m = first; m < last; m++) {
+            BatchBuild& build = builds[m];
+            build.refCount = buildTree( build.root, build.maxRefs, build.nextNode );
+        }
+    };
+    TaskGroup group;
+    for (int first = 0, last = 0; first < count; first = last) {
+        int tris = 0;
+        while (last < count && (last == first || tris + meshes[last].triCount <= Config::parallelGrain)) {
+            tris += meshes[last++].triCount;
+        }
+        if (bvhSettings.parallel && count > 1) {
+            threadPool().submit(group, [first, last, &buildRange] { buildRange( first, last ); });
+        } else {
+            buildRange( first, last );
+        }
+    }
+    threadPool().wait(group);
+
+    if (bvhSettings.presplit) {
+        buildTris = &triangles;
+        for (const BatchBuild& build : builds) {
+            for (int i = build.refStart; i < build.refStart + build.refCount; i++) triIndices[i] = pieceSource[triIndices[i]];
+        }
+        std::vector<Tri>().swap(pieces);
+        std::vector<int>().swap(pieceSource);
+    }
+
+    // close the gaps the worst case ranges left, moving every tree down by
+    // an even number of slots so its pairs stay aligned
+    usedNodes = nodeBase;
+    int refEnd = refBase;
+    for (int m = 0; m < count; m++) {
+        const BatchBuild& build = builds[m];
+        alignNextRoot();
+        int root = usedNodes;
+        int used = build.nextNode - build.root;
+        int nodeShift = build.root - root;
+        int refShift = build.refStart - refEnd;
+        for (int n = 0; n < used; n++) {
+            Node node = nodes[build.root + n];
+            node.start -= node.count > 0 ? refShift : nodeShift;
+            nodes[root + n] = node;
+        }
+        std::copy(triIndices.begin() + build.refStart, triIndices.begin() + build.refStart + build.refCount,
+                  triIndices.begin() + refEnd);
+        meshes[m].bvhRoot = root;
+        usedNodes += used;
+        refEnd += build.refCount;
+    }
+    triIndices.resize(refEnd);
+
+    std::vector<float> costs(count);
+    parallelFor(0, count, 1, [&](int lo, int hi) {
+        for (int m = lo; m < hi; m++) costs[m] = refittedSAH(meshes[m]);
+    });
+    for (int m = 0; m < count; m++) {
+        buildCosts[meshes[m].bvhRoot] = costs[m];
+        checkBVH(meshes[m]);
+    }
+}
+
+void buildBVH(Mesh& mesh) {
+    std::vector<Mesh> single = { mesh };
+    buildBatch(single);
+    mesh = single[0];
+}
+
+void buildBVHs(std::vector<Mesh>& meshes) {
+    buildBatch(meshes);
+}
+
+// Transform of the first instance of meshes[meshIdx], which camera-weighted
+// builds of a mesh placed several times are tuned for.
+static mat4 meshToWorld(int meshIdx) {
+    for (const Instance& inst : instances) {
+        if (inst.meshIdx == meshIdx) return instanceToWorld(inst);
+    }
+    return mat4(1.0f);
+}
+
+void rebuildAllBVHs(std::vector<Mesh>& meshes) {
+    nodes.clear();
+    triIndices.clear();
+    usedNodes = 0;
+    buildCosts.clear();
+    dynamicRanges.clear();
+    freePairs.clear();
+    if (!buildCamera.active) {
+        buildBatch(meshes);
+        return;
+    }
+
+    // every mesh sees the camera from its own object space, one batch each
+    for (int m = 0; m < (int)meshes.size(); m++) {
+        placeBuildCamera(meshToWorld(m));
+        std::vector<Mesh> single = { meshes[m] };
+        buildBatch(single);
+        meshes[m] = single[0];
+    }
+    placeBuildCamera(mat4(1.0f));
+}
+
+static int treeDepth(const std::vector<Node>& tree, int root) {
+    int depth = 0;
+    std::vector<std::pair<int, int>> stack = { { root, 0 } };
+    while (!stack.empty()) {
+        std::pair<int, int> item = stack.back();
+        stack.pop_back();
+        depth = std::max(depth, item.second);
+        const Node& node = tree[item.first];
+        if (node.count > 0) continue;
+        stack.push_back({ node.start, item.second + 1 });
+        stack.push_back({ node.start + 1, item.second + 1 });
+    }
+    return depth;
+}
+
+int bvhDepth(const Mesh& mesh) {
+    return mesh.bvhRoot < 0 ? 0 : treeDepth(nodes, mesh.bvhRoot);
+}
+
+float computeSAH(const Mesh& mesh) {
+    const Node& root = nodes[mesh.bvhRoot];
+    float rootArea = area(root.min, root.max);
+    if (rootArea <= 0.0f) return 0.0f;
+
+    float cost = 0.0f;
+    std::vector<int> stack = { mesh.bvhRoot };
+    while (!stack.empty()) {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+        if (node.count > 0) {
+            cost += leafCost(area(node.min, node.max), node.count);
+        } else {
+            cost += bvhSettings.traversalCost * area(node.min, node.max);
+            stack.push_back(node.start);
+            stack.push_back(node.start + 1);
+        }
+    }
+    return cost / rootArea;
+}
+
+static int collapseNode(int idx, int width) {
+    int blocks = width / 4;
+    int base = (int)wideNodes.size();
+    wideNodes.resize(base + blocks);
+    for (int b = 0; b < blocks; b++) {
+        WideNode& wide = wideNodes[base + b];
+        wide.minX = wide.minY = wide.minZ = vec4(0.0f);
+        wide.maxX = wide.maxY = wide.maxZ = vec4(0.0f);
+        wide.child = ivec4(0);
+        wide.count = ivec4(-1);
+    }
+
+    // pull up grandchildren, always opening the inner child with the largest area
+    int children[8];
+    int childCount = 0;
+    if (nodes[idx].count > 0) {
+        children[childCount++] = idx;
+    } else {
+        children[childCount++] = nodes[idx].start;
+        children[childCount++] = nodes[idx].start + 1;
+    }
+    while (childCount < width) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (int k = 0; k < childCount; k++) {
+            const Node& child = nodes[children[k]];
+            float a = area(child.min, child.max);
+            if (child.count == 0 && a > bestArea) {
+                bestArea = a;
+                best = k;
+            }
+        }
+        if (best < 0) break;
+        int opened = children[best];
+        children[best] = nodes[opened].start;
+        children[childCount++] = nodes[opened].start + 1;
+    }
+
+    for (int k = 0; k < childCount; k++) {
+        const Node& child = nodes[children[k]];
+        int target = child.count > 0 ? child.start : collapseNode(children[k], width);
+        WideNode& wide = wideNodes[base + k / 4];
+        int lane = k % 4;
+        wide.minX[lane] = child.min.x;
+        wide.minY[lane] = child.min.y;
+        wide.minZ[lane] = child.min.z;
+        wide.maxX[lane] = child.max.x;
+        wide.maxY[lane] = child.max.y;
+        wide.maxZ[lane] = child.max.z;
+        wide.child[lane] = target;
+        wide.count[lane] = child.count;
+    }
+    return base;
+}
+
+int traceWidth() {
+    return bvhSettings.compress ? std::max(bvhSettings.width, 4) : bvhSettings.width;
+}
+
+int collapseBVH(const Mesh& mesh, int width) {
+    return collapseNode(mesh.bvhRoot, width > 4 ? 8 : 4);
+}
+
+// Biased float exponent of the smallest power of two step that spans lo..hi in
+// 255 steps. Power of two steps keep q * step exact when decoding.
+static uint32_t quantizeExponent(float lo, float hi) {
+    int e = -126;
+    if (hi > lo) std::frexp((hi - lo) / 255.0f, &e);
+    e = glm::clamp(e, -126, 127);
+    while (e < 127 && lo + 255.0f * std::ldexp(1.0f, e) < hi) e++;
+    return uint32_t(e + 127);
+}
+
+static uint32_t quantizeLo(float v, float origin, float step) {
+    int q = glm::clamp((int)std::floor((v - origin) / step), 0, 255);
+    while (q > 0 && origin + float(q) * step > v) q--;
+    return uint32_t(q);
+}
+
+static uint32_t quantizeHi(float v, float origin, float step) {
+    int q = glm::clamp((int)std::ceil((v - origin) / step), 0, 255);
+    while (q < 255 && origin + float(q) * step < v) q++;
+    return uint32_t(q);
+}
+
+static float exponentStep(uint32_t exponents, int axis) {
+    return std::ldexp(1.0f, int((exponents >> (8 * axis)) & 0xff) - 127);
+}
+
+static QuantizedNode quantizeBlock(const WideNode& wide) {
+    Box block;
+    for (int l = 0; l < 4; l++) {
+        if (wide.count[l] < 0) continue;
+        block.grow(vec3(wide.minX[l], wide.minY[l], wide.minZ[l]));
+        block.grow(vec3(wide.maxX[l], wide.maxY[l], wide.maxZ[l]));
+    }
+    if (block.min.x > block.max.x) block.min = block.max = vec3(0.0f);
+
+    uint32_t exponents = 0;
+    for (int a = 0; a < 3; a++) exponents |= quantizeExponent(block.min[a], block.max[a]) << (8 * a);
+    vec3 step = vec3(exponentStep(exponents, 0), exponentStep(exponents, 1), exponentStep(exponents, 2));
+
+    uint32_t lo[3] = { 0, 0, 0 };
+    uint32_t hi[3] = { 0, 0, 0 };
+    uint32_t counts[2] = { 0, 0 };
+    for (int l = 0; l < 4; l++) {
+        uint32_t count = wide.count[l] < 0 ? 0xffff : uint32_t(wide.count[l]);
+        counts[l / 2] |= count << (16 * (l % 2));
+        if (wide.count[l] < 0) continue;
+        vec3 cmin = vec3(wide.minX[l], wide.minY[l], wide.minZ[l]);
+        vec3 cmax = vec3(wide.maxX[l], wide.maxY[l], wide.maxZ[l]);
+        for (int a = 0; a < 3; a++) {
+            lo[a] |= quantizeLo(cmin[a], block.min[a], step[a]) << (8 * l);
+            hi[a] |= quantizeHi(cmax[a], block.min[a], step[a]) << (8 * l);
+        }
+    }
+
+    QuantizedNode node;
+    float packed;
+    memcpy(&packed, &exponents, sizeof(float));
+    node.origin = vec4(block.min, packed);
+    node.child = wide.child;
+    node.bounds0 = uvec4(lo[0], lo[1], lo[2], hi[0]);
+    node.bounds1 = uvec4(hi[1], hi[2], counts[0], counts[1]);
+    return node;
+}
+
+void quantizeWideBVH() {
+    quantizedNodes.resize(wideNodes.size());
+    for (size_t i = 0; i < wideNodes.size(); i++) quantizedNodes[i] = quantizeBlock(wideNodes[i]);
+}
+
+WideNode decodeQuantizedNode(const QuantizedNode& node) {
+    uint32_t exponents;
+    memcpy(&exponents, &node.origin.w, sizeof(float));
+    vec3 step = vec3(exponentStep(exponents, 0), exponentStep(exponents, 1), exponentStep(exponents, 2));
+
+    WideNode wide;
+    for (int l = 0; l < 4; l++) {
+        int shift = 8 * l;
+        wide.minX[l] = node.origin.x + float((node.bounds0.x >> shift) & 0xff) * step.x;
+        wide.minY[l] = node.origin.y + float((node.bounds0.y >> shift) & 0xff) * step.y;
+        wide.minZ[l] = node.origin.z + float((node.bounds0.z >> shift) & 0xff) * step.z;
+        wide.maxX[l] = node.origin.x + float((node.bounds0.w >> shift) & 0xff) * step.x;
+        wide.maxY[l] = node.origin.y + float((node.bounds1.x >> shift) & 0xff) * step.y;
+        wide.maxZ[l] = node.origin.z + float((node.bounds1.y >> shift) & 0xff) * step.z;
+        uint32_t count = ((l < 2 ? node.bounds1.z : node.bounds1.w) >> (16 * (l % 2))) & 0xffff;
+        wide.count[l] = count == 0xffff ? -1 : int(count);
+    }
+    wide.child = node.child;
+    return wide;
+}
+
+struct TreeletCosts {
+    int base;
+    std::vector<float> cost; // SAH cost of the subtree below each node
+    std::vector<int> tris;   // triangle references below each node
+
+    float& costOf(int idx) { return cost[idx - base]; }
+    int& trisOf(int idx) { return tris[idx - base]; }
+};
+
+// Optimal restructuring of the treelet below root (Karras and Aila): grows a
+// treelet of up to treeletSize leaves by repeatedly expanding the leaf with
+// the largest area, finds the cheapest binary tree over those leaves with a
+// dynamic program over all leaf subsets, and rewires the treelet's existing
+// child pairs into that topology when it lowers the SAH cost.
+static void restructureTreelet(int root, TreeletCosts& costs, int treeletSize) {
+    const int maxLeaves = Config::maxTreeletSize;
+    int leaves[maxLeaves];
+    int pairs[maxLeaves];
+    int leafCount = 2;
+    int pairCount = 1;
+    leaves[0] = nodes[root].start;
+    leaves[1] = nodes[root].start + 1;
+    pairs[0] = nodes[root].start;
+
+    while (leafCount < treeletSize) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (int k = 0; k < leafCount; k++) {
+            const Node& node = nodes[leaves[k]];
+            float a = area(node.min, node.max);
+            if (node.count == 0 && a > bestArea) {
+                bestArea = a;
+                best = k;
+            }
+        }
+        if (best < 0) break;
+        int expanded = leaves[best];
+        pairs[pairCount++] = nodes[expanded].start;
+        leaves[best] = nodes[expanded].start;
+        leaves[leafCount++] = nodes[expanded].start + 1;
+    }
+    if (leafCount < 3) return;
+
+    int full = (1 << leafCount) - 1;
+    float subsetArea[1 << maxLeaves];
+    float opt[1 << maxLeaves];
+    int part[1 << maxLeaves];
+    for (int s = 1; s <= full; s++) {
+        Box box;
+        for (int k = 0; k < leafCount; k++) {
+            if (!(s >> k & 1)) continue;
+            box.grow(nodes[leaves[k]].min);
+            box.grow(nodes[leaves[k]].max);
+        }
+        subsetArea[s] = sahArea(box.min, box.max);
+    }
+
+    // every proper subset of s is numerically smaller than s, so a single
+    // ascending pass sees all partitions of s already solved
+    for (int s = 1; s <= full; s++) {
+        if ((s & (s - 1)) == 0) {
+            opt[s] = costs.costOf(leaves[__builtin_ctz(s)]);
+            continue;
+        }
+        int low = s & -s;
+        float best = FLT_MAX;
+        for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+            if (!(p & low)) continue;
+            float c = opt[p] + opt[s ^ p];
+            if (c < best) {
+                best = c;
+                part[s] = p;
+            }
+        }
+        opt[s] = bvhSettings.traversalCost * subsetArea[s] + best;
+    }
+    if (opt[full] >= costs.costOf(root) * (1.0f - 1e-5f)) return;
+
+    Node savedNodes[maxLeaves];
+    float savedCosts[maxLeaves];
+    int savedTris[maxLeaves];
+    for (int k = 0; k < leafCount; k++) {
+        savedNodes[k] = nodes[leaves[k]];
+        savedCosts[k] = costs.costOf(leaves[k]);
+        savedTris[k] = costs.trisOf(leaves[k]);
+    }
+
+    int nextPair = 0;
+    std::function<void(int, int)> emit = [&](int s, int slot) {
+        if ((s & (s - 1)) == 0) {
+            int k = __builtin_ctz(s);
+            nodes[slot] = savedNodes[k];
+            costs.costOf(slot) = savedCosts[k];
+            costs.trisOf(slot) = savedTris[k];
+            return;
+        }
+        int pair = pairs[nextPair++];
+        Node& node = nodes[slot];
+        node.min = vec3(FLT_MAX);
+        node.max = vec3(-FLT_MAX);
+        int tris = 0;
+        for (int k = 0; k < leafCount; k++) {
+            if (!(s >> k & 1)) continue;
+            node.min = min(node.min, savedNodes[k].min);
+            node.max = max(node.max, savedNodes[k].max);
+            tris += savedTris[k];
+        }
+        node.start = pair;
+        node.count = 0;
+        costs.costOf(slot) = opt[s];
+        costs.trisOf(slot) = tris;
+        emit(part[s], pair);
+        emit(s ^ part[s], pair + 1);
+    };
+    emit(full, root);
+}
+
+// Post-order walk that restructures the treelet of every node once both of
+// its subtrees are done. Sibling subtrees touch disjoint nodes, so the upper
+// levels fork them onto the thread pool.
+static void optimizeSubtree(int idx, TreeletCosts& costs, int depth) {
+    Node& node = nodes[idx];
+    if (node.count > 0) {
+        costs.costOf(idx) = leafCost(sahArea(node.min, node.max), node.count);
+        costs.trisOf(idx) = node.count;
+        return;
+    }
+
+    int left = node.start;
+    if (bvhSettings.parallel && depth < Config::optimizeTaskDepth) {
+        TaskGroup group;
+        threadPool().submit(group, [&costs, left, depth] { optimizeSubtree( left, costs, depth + 1 ); });
+        optimizeSubtree( left + 1, costs, depth + 1 );
+        threadPool().wait(group);
+    } else {
+        optimizeSubtree( left, costs, depth + 1 );
+        optimizeSubtree( left + 1, costs, depth + 1 );
+    }
+
+    costs.costOf(idx) = bvhSettings.traversalCost * sahArea(node.min, node.max) + costs.costOf(left) + costs.costOf(left + 1);
+    costs.trisOf(idx) = costs.trisOf(left) + costs.trisOf(left + 1);
+    if (costs.trisOf(idx) >= Config::treeletMinTris) {
+        restructureTreelet(idx, costs, clamp(bvhSettings.treeletSize, 3, Config::maxTreeletSize));
+    }
+}
+
+void optimizeBVH(Mesh& mesh) {
+    if (mesh.bvhRoot < 0) return;
+    if (buildCamera.active) {
+        for (int m = 0; m < (int)meshes.size(); m++) {
+            if (meshes[m].bvhRoot == mesh.bvhRoot) placeBuildCamera(meshToWorld(m));
+        }
+    }
+
+    std::vector<int> order;
+    collectNodes(mesh.bvhRoot, order);
+    int lo = *std::min_element(order.begin(), order.end());
+    int hi = *std::max_element(order.begin(), order.end());
+
+    TreeletCosts costs;
+    costs.base = lo;
+    costs.cost.resize(hi - lo + 1);
+    costs.tris.resize(hi - lo + 1);
+    for (int pass = 0; pass < bvhSettings.optimizePasses; pass++) {
+        optimizeSubtree(mesh.bvhRoot, costs, 0);
+    }
+    buildCosts[mesh.bvhRoot] = refittedSAH(mesh);
+    if (buildCamera.active) placeBuildCamera(mat4(1.0f));
+    checkBVH(mesh);
+}
+
+// The layouts below order child pairs, the unit the traversal fetches, and
+// identify each pair by the index of its first node.
+static void childPairs(int pair, int out[2], int& count) {
+    count = 0;
+    for (int i = pair; i <= pair + 1; i++) {
+        if (nodes[i].count == 0) out[count++] = nodes[i].start;
+    }
+}
+
+static void layoutDepthFirst(int rootPair, std::vector<int>& order) {
+    std::vector<int> stack = { rootPair };
+    while (!stack.empty()) {
+        int pair = stack.back();
+        stack.pop_back();
+        order.push_back(pair);
+        int children[2];
+        int count;
+        childPairs(pair, children, count);
+        for (int k = count - 1; k >= 0; k--) stack.push_back(children[k]);
+    }
+}
+
+static int pairHeight(int pair) {
+    int children[2];
+    int count;
+    childPairs(pair, children, count);
+    int height = 0;
+    for (int k = 0; k < count; k++) height = std::max(height, pairHeight(children[k]));
+    return height + 1;
+}
+
+static void pairsAtDepth(int pair, int depth, std::vector<int>& out) {
+    if (depth == 0) {
+        out.push_back(pair);
+        return;
+    }
+    int children[2];
+    int count;
+    childPairs(pair, children, count);
+    for (int k = 0; k < count; k++) pairsAtDepth(children[k], depth - 1, out);
+}
+
+// Van Emde Boas: the top half of the levels first, then every subtree hanging
+// below it, each laid out the same way recursively.
+static void layoutVanEmdeBoas(int pair, int height, std::vector<int>& order) {
+    if (height == 1) {
+        order.push_back(pair);
+        return;
+    }
+    int topHeight = height / 2;
+    layoutVanEmdeBoas(pair, topHeight, order);
+    std::vector<int> bottoms;
+    pairsAtDepth(pair, topHeight, bottoms);
+    for (int bottom : bottoms) layoutVanEmdeBoas(bottom, height - topHeight, order);
+}
+
+// Fills blocks of blockPairs pairs with treelets grown from the block root by
+// always taking the frontier pair with the largest area, the one rays are most
+// likely to reach. Whatever is left on the frontier roots the next blocks.
+static void layoutTreelets(int rootPair, int blockPairs, std::vector<int>& order) {
+    auto pairArea = [](int pair) {
+        return area(min(nodes[pair].min, nodes[pair + 1].min), max(nodes[pair].max, nodes[pair + 1].max));
+    };
+
+    std::vector<int> roots = { rootPair };
+    std::vector<int> frontier;
+    while (!roots.empty()) {
+        frontier.assign(1, roots.back());
+        roots.pop_back();
+        for (int taken = 0; taken < blockPairs && !frontier.empty(); taken++) {
+            int best = 0;
+            for (int k = 1; k < (int)frontier.size(); k++) {
+                if (pairArea(frontier[k]) > pairArea(frontier[best])) best = k;
+            }
+            int pair = frontier[best];
+            frontier.erase(frontier.begin() + best);
+            order.push_back(pair);
+
+            int children[2];
+            int count;
+            childPairs(pair, children, count);
+            frontier.insert(frontier.end(), children, children + count);
+        }
+        roots.insert(roots.end(), frontier.rbegin(), frontier.rend());
+    }
+}
+
+void layoutBVH(Mesh& mesh, BVHLayout layout) {
+    if (mesh.bvhRoot < 0 || nodes[mesh.bvhRoot].count > 0 || layout == BVHLayout::Build) return;
+
+    int rootPair = nodes[mesh.bvhRoot].start;
+    std::vector<int> order;
+    switch (layout) {
+        case BVHLayout::DepthFirst:
+            layoutDepthFirst(rootPair, order);
+            break;
+        case BVHLayout::VanEmdeBoas:
+            layoutVanEmdeBoas(rootPair, pairHeight(rootPair), order);
+            break;
+        default:
+            layoutTreelets(rootPair, std::max(1, Config::layoutBlockBytes / (2 * (int)sizeof(Node))), order);
+            break;
+    }
+
+    // hand the mesh's own pair slots out again in the new order
+    std::vector<int> slots = order;
+    std::sort(slots.begin(), slots.end());
+    std::unordered_map<int, int> slotOf;
+    for (int k = 0; k < (int)order.size(); k++) slotOf[order[k]] = slots[k];
+
+    std::vector<Node> moved(order.size() * 2);
+    for (int k = 0; k < (int)order.size(); k++) {
+        moved[2 * k] = nodes[order[k]];
+        moved[2 * k + 1] = nodes[order[k] + 1];
+    }
+    for (int k = 0; k < (int)order.size(); k++) {
+        for (int j = 0; j < 2; j++) {
+            Node node = moved[2 * k + j];
+            if (node.count == 0) node.start = slotOf[node.start];
+            nodes[slots[k] + j] = node;
+        }
+    }
+    nodes[mesh.bvhRoot].start = slotOf[rootPair];
+    checkBVH(mesh);
+}
+
+static std::vector<int> freeTLAS; // first slots of the tlas pairs released by removeSphere()
+static std::vector<int> movedInstances; // by moveInstance() since the last updateTLAS()
+static float tlasBuildCost = 0.0f; // inner entry area over root area right after the last clustering
+
+// Links from the leaves up, for updateTLAS(). They are made again after the
+// TLAS changed shape or bounds elsewhere, see linkTLAS().
+static std::vector<int> tlasParent;    // by entry, -1 for the root and unused slots
+static std::vector<int> instanceEntry; // leaf of each instance, -1 without one
+static float tlasInnerArea = 0.0f;     // summed area of the inner entries
+static bool tlasLinked = false;
+
+Instance makeInstance(int meshIdx, const mat4& toWorld) {
+    mat4 toObject = inverse(toWorld);
+    Instance inst;
+    for (int r = 0; r < 3; r++) {
+        inst.toWorld[r] = vec4(toWorld[0][r], toWorld[1][r], toWorld[2][r], toWorld[3][r]);
+        inst.toObject[r] = vec4(toObject[0][r], toObject[1][r], toObject[2][r], toObject[3][r]);
+    }
+    inst.meshIdx = meshIdx;
+    inst.pad[0] = inst.pad[1] = inst.pad[2] = 0;
+    return inst;
+}
+
+mat4 instanceToWorld(const Instance& inst) {
+    mat4 toWorld(1.0f);
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 3; r++) toWorld[c][r] = inst.toWorld[r][c];
+    }
+    return toWorld;
+}
+
+void instanceBounds(const Instance& inst, vec3& outMin, vec3& outMax) {
+    const Node& root = nodes[meshes[inst.meshIdx].bvhRoot];
+    outMin = vec3(FLT_MAX);
+    outMax = vec3(-FLT_MAX);
+    for (int k = 0; k < 8; k++) {
+        vec4 corner = vec4(k & 1 ? root.max.x : root.min.x, k & 2 ? root.max.y : root.min.y, k & 4 ? root.max.z : root.min.z, 1.0f);
+        vec3 p = vec3(dot(inst.toWorld[0], corner), dot(inst.toWorld[1], corner), dot(inst.toWorld[2], corner));
+        outMin = min(outMin, p);
+        outMax = max(outMax, p);
+    }
+}
+
+void sceneBounds(vec3& outMin, vec3& outMax) {
+    outMin = vec3(FLT_MAX);
+    outMax = vec3(-FLT_MAX);
+    for (const Instance& inst : instances) {
+        if (meshes[inst.meshIdx].bvhRoot < 0) continue;
+        vec3 boundsMin, boundsMax;
+        instanceBounds(inst, boundsMin, boundsMax);
+        outMin = min(outMin, boundsMin);
+        outMax = max(outMax, boundsMax);
+    }
+    for (const Sph& sph : spheres) {
+        outMin = min(outMin, sph.center - vec3(sph.radius));
+        outMax = max(outMax, sph.center + vec3(sph.radius));
+    }
+}
+
+// Copies the tree below rootIdx with the root at 0 and the children of every
+// inner entry next to each other, as GPUTLAS expects. Pairs follow depth first.
+static std::vector<TLAS> getOrdered(const std::vector<TLAS>& allEntries, int rootIdx) {
+    std::vector<TLAS> ordered;
+    ordered.reserve(allEntries.size());
+    ordered.push_back(allEntries[rootIdx]);
+
+    std::function<void(int)> dfs = [&](int newIdx) {
+        if (ordered[newIdx].idx != -1) {
+            ordered[newIdx].left = 0;
+            ordered[newIdx].right = 0;
+            return;
+        }
+
+        int pair = (int)ordered.size();
+        ordered.push_back(allEntries[ordered[newIdx].left]);
+        ordered.push_back(allEntries[ordered[newIdx].right]);
+        ordered[newIdx].left = pair;
+        ordered[newIdx].right = pair + 1;
+        dfs(pair);
+        dfs(pair + 1);
+    };
+
+    dfs(0);
+    return ordered;
+}
+
+static const int sphereRoot = 1;
+
+// Writes the cluster tree below c into sphereNodes[idx] like emitPLOC(), the
+// spheres of each leaf going to sphereIndices from offset on.
+static void emitSphereNodes(int idx, int c, int offset, const std::vector<Cluster>& clusters, const int* ids) {
+    const Cluster& cl = clusters[c];
+    Node& node = sphereNodes[idx];
+    node.min = cl.box.min;
+    node.max = cl.box.max;
+
+    if (isLeafCluster(clusters, cl)) {
+        collectPrims(clusters, c, ids, sphereIndices.data(), offset);
+        node.start = offset;
+        node.count = cl.count;
+        return;
+    }
+
+    int leftChildIdx = (int)sphereNodes.size();
+    sphereNodes.resize(leftChildIdx + 2);
+    sphereNodes[idx].start = leftChildIdx;
+    sphereNodes[idx].count = 0;
+    emitSphereNodes( leftChildIdx, cl.left, offset, clusters, ids );
+    emitSphereNodes( leftChildIdx + 1, cl.right, offset + clusters[cl.left].count, clusters, ids );
+}
+
+// Clusters all spheres into sphereNodes with the PLOC clustering. The root
+// sits at sphereRoot so that child pairs start on even indices.
+static void buildSphereBVH() {
+    int count = (int)spheres.size();
+    ScratchArray<Box> boxes(buildScratch, count);
+    ScratchArray<int> ids(buildScratch, count);
+    for (int i = 0; i < count; i++) {
+        boxes[i].min = spheres[i].center - vec3(spheres[i].radius);
+        boxes[i].max = spheres[i].center + vec3(spheres[i].radius);
+        ids[i] = i;
+    }
+    std::vector<Cluster> clusters = clusterPLOC(boxes.data, count, bvhSettings.plocRadius);
+
+    sphereNodes.clear();
+    sphereNodes.reserve(2 * count);
+    sphereNodes.resize(sphereRoot + 1); // node 0 stays unused
+    sphereIndices.resize(count);
+    emitSphereNodes(sphereRoot, (int)clusters.size() - 1, 0, clusters, ids.data);
+}
+
+static float entryArea(const TLAS& entry) {
+    return area(vec3(entry.min), vec3(entry.max));
+}
+
+// Replaces tlas by the PLOC clustering of the leaves in allEntries, which
+// grows by the parents.
+static void clusterTLAS(std::vector<TLAS>& allEntries) {
+    freeTLAS.clear();
+    if (allEntries.empty()) {
+        tlas.clear();
+        tlasBuildCost = 0.0f;
+        return;
+    }
+
+    // same bottom-up clustering as the PLOC builder, merging nearest neighbours
+    // in Morton order instead of searching all pairs for every merge
+    int count = (int)allEntries.size();
+    ScratchArray<Box> boxes(buildScratch, count);
+    for (int i = 0; i < count; i++) {
+        boxes[i].min = vec3(allEntries[i].min);
+        boxes[i].max = vec3(allEntries[i].max);
+    }
+    std::vector<Cluster> clusters = clusterPLOC(boxes.data, count, Config::tlasRadius);
+
+    // clusters past the primitives are parents, appended in the same order
+    auto entryOf = [&](int c) { return c < count ? clusters[c].prim : c; };
+    for (int c = count; c < (int)clusters.size(); c++) {
+        TLAS parent;
+        parent.min = vec4(clusters[c].box.min, 1.0f);
+        parent.max = vec4(clusters[c].box.max, 1.0f);
+        parent.idx = -1;
+        parent.type = -1;
+        parent.left = entryOf(clusters[c].left);
+        parent.right = entryOf(clusters[c].right);
+        allEntries.push_back(parent);
+    }
+
+    int rootIdx = entryOf((int)clusters.size() - 1);
+
+    tlas = getOrdered(allEntries, rootIdx);
+    tlasLinked = false;
+
+    float innerArea = 0.0f;
+    for (const TLAS& entry : tlas) {
+        if (entry.idx == -1) innerArea += entryArea(entry);
+    }
+    float rootArea = entryArea(tlas[0]);
+    tlasBuildCost = rootArea > 0.0f ? innerArea / rootArea : 0.0f;
+}
+
+void buildTLAS() {
+    edits.tlas.all = true;
+    edits.sphereNodes.all = true;
+    edits.sphereIndices.all = true;
+    std::vector<TLAS> allEntries;
+    allEntries.reserve(2 * (instances.size() + spheres.size()));
+
+    for (int i = 0; i < (int)instances.size(); ++i) {
+        if (meshes[instances[i].meshIdx].bvhRoot < 0) continue;
+
+        vec3 boundsMin, boundsMax;
+        instanceBounds(instances[i], boundsMin, boundsMax);
+
+        TLAS entry;
+        entry.min = vec4(boundsMin, 1.0f);
+        entry.max = vec4(boundsMax, 1.0f);
+        entry.idx = i;
+        entry.type = 0;
+        entry.left = 0;
+        entry.right = 0;
+
+        allEntries.push_back(entry);
+    }
+
+    BuildScope scope(0);
+    sphereNodes.clear();
+    sphereIndices.clear();
+    // many spheres go below a single leaf in a BVH of their own, few get a leaf each
+    if ((int)spheres.size() > Config::sphereBVHMin) {
+        buildSphereBVH();
+        const Node& root = sphereNodes[sphereRoot];
+
+        TLAS entry;
+        entry.min = vec4(root.min, 1.0f);
+        entry.max = vec4(root.max, 1.0f);
+        entry.idx = sphereRoot;
+        entry.type = 2;
+        entry.left = 0;
+        entry.right = 0;
+
+        allEntries.push_back(entry);
+    } else {
+        for (int si = 0; si < (int)spheres.size(); ++si) {
+            const Sph& sph = spheres[si];
+
+            TLAS entry;
+            entry.min = vec4(sph.center - vec3(sph.radius), 1.0f);
+            entry.max = vec4(sph.center + vec3(sph.radius), 1.0f);
+            entry.idx = si;
+            entry.type = 1;
+            entry.left = 0;
+            entry.right = 0;
+
+            allEntries.push_back(entry);
+        }
+    }
+
+    clusterTLAS(allEntries);
+    checkTLAS();
+}
+
+// Two adjacent tlas slots for the children of an entry, returns the first.
+static int allocTLASPair() {
+    if (!freeTLAS.empty()) {
+        int slot = freeTLAS.back();
+        freeTLAS.pop_back();
+        return slot;
+    }
+    tlas.resize(tlas.size() + 2);
+    edits.tlas.all = true;
+    return (int)tlas.size() - 2;
+}
+
+static void refitEntry(int idx) {
+    TLAS& entry = tlas[idx];
+    entry.min = min(tlas[entry.left].min, tlas[entry.right].min);
+    entry.max = max(tlas[entry.left].max, tlas[entry.right].max);
+}
+
+// TLAS counterpart of rotateNode(). Entries are swapped rather than child
+// links, so children stay next to each other.
+static void rotateEntry(int idx) {
+    int left = tlas[idx].left;
+    float bestGain = 0.0f;
+    int swapA = -1;
+    int swapB = -1;
+    for (int side = 0; side < 2; side++) {
+        int child = left + side;
+        int sibling = left + 1 - side;
+        const TLAS& sib = tlas[sibling];
+        if (sib.idx != -1) continue;
+        for (int k = 0; k < 2; k++) {
+            const TLAS& kept = tlas[sib.left + 1 - k];
+            const TLAS& moved = tlas[child];
+            float gain = entryArea(sib) - area(min(vec3(moved.min), vec3(kept.min)), max(vec3(moved.max), vec3(kept.max)));
+            if (gain > bestGain) {
+                bestGain = gain;
+                swapA = child;
+                swapB = sib.left + k;
+            }
+        }
+    }
+    if (swapA < 0) return;
+    std::swap(tlas[swapA], tlas[swapB]);
+    int refitted = left + (swapA == left ? 1 : 0);
+    refitEntry(refitted);
+    edited(edits.tlas, swapA);
+    edited(edits.tlas, swapB);
+    edited(edits.tlas, refitted);
+}
+
+// Adds leaf to the TLAS like insertTriangle() adds a triangle to a mesh BVH.
+// The root stays at index 0.
+static void insertEntry(const TLAS& leaf) {
+    tlasLinked = false;
+    if (tlas.empty()) {
+        tlas.push_back(leaf);
+        edits.tlas.all = true;
+        return;
+    }
+
+    struct Candidate {
+        int entry;
+        int parent;
+        float inherited;
+    };
+    std::vector<Candidate> candidates = { { 0, -1, 0.0f } };
+    std::vector<int> stack = { 0 };
+    float leafArea = entryArea(leaf);
+    float bestCost = FLT_MAX;
+    int best = 0;
+    while (!stack.empty()) {
+        int pos = stack.back();
+        Candidate c = candidates[pos];
+        stack.pop_back();
+        const TLAS& entry = tlas[c.entry];
+        float direct = area(min(vec3(entry.min), vec3(leaf.min)), max(vec3(entry.max), vec3(leaf.max)));
+        if (direct + c.inherited < bestCost) {
+            bestCost = direct + c.inherited;
+            best = pos;
+        }
+        float inherited = c.inherited + direct - entryArea(entry);
+        if (entry.idx == -1 && leafArea + inherited < bestCost) {
+            candidates.push_back({ entry.left, pos, inherited });
+            stack.push_back((int)candidates.size() - 1);
+            candidates.push_back({ entry.right, pos, inherited });
+            stack.push_back((int)candidates.size() - 1);
+        }
+    }
+
+    int sibling = candidates[best].entry;
+    int moved = allocTLASPair();
+    int added = moved + 1;
+    tlas[moved] = tlas[sibling];
+    tlas[added] = leaf;
+    TLAS& parent = tlas[sibling];
+    parent.idx = -1;
+    parent.type = -1;
+    parent.left = moved;
+    parent.right = added;
+    edited(edits.tlas, moved);
+    edited(edits.tlas, added);
+    for (int pos = best; pos >= 0; pos = candidates[pos].parent) {
+        refitEntry(candidates[pos].entry);
+        edited(edits.tlas, candidates[pos].entry);
+        rotateEntry(candidates[pos].entry);
+    }
+}
+
+// Removes the leaf of (type, idx) below entry, promoting siblings like
+// dropReferences(). Returns true once it was found.
+static bool removeEntry(int entry, int type, int idx, const vec3& boundsMin, const vec3& boundsMax, bool& emptied) {
+    tlasLinked = false;
+    TLAS& e = tlas[entry];
+    if (!overlaps(vec3(e.min), vec3(e.max), boundsMin, boundsMax)) return false;
+    if (e.idx != -1) {
+        emptied = e.type == type && e.idx == idx;
+        return emptied;
+    }
+
+    int children[2] = { e.left, e.right };
+    for (int k = 0; k < 2; k++) {
+        bool childEmptied = false;
+        if (!removeEntry(children[k], type, idx, boundsMin, boundsMax, childEmptied)) continue;
+        if (childEmptied) {
+            tlas[entry] = tlas[children[1 - k]];
+            freeTLAS.push_back(children[0]);
+        } else {
+            refitEntry(entry);
+        }
+        edited(edits.tlas, entry);
+        return true;
+    }
+    return false;
+}
+
+// Points the leaf of (type, from) at to, bounds being the leaf's bounds.
+static bool relinkEntry(int entry, int type, int from, int to, const vec3& boundsMin, const vec3& boundsMax) {
+    TLAS& e = tlas[entry];
+    if (!overlaps(vec3(e.min), vec3(e.max), boundsMin, boundsMax)) return false;
+    if (e.idx != -1) {
+        if (e.type != type || e.idx != from) return false;
+        e.idx = to;
+        edited(edits.tlas, entry);
+        return true;
+    }
+    return relinkEntry(e.left, type, from, to, boundsMin, boundsMax) ||
+           relinkEntry(e.right, type, from, to, boundsMin, boundsMax);
+}
+
+int insertInstance(int meshIdx, const mat4& toWorld) {
+    instances.push_back(makeInstance(meshIdx, toWorld));
+    edits.instances.all = true;
+    vec3 boundsMin, boundsMax;
+    instanceBounds(instances.back(), boundsMin, boundsMax);
+    TLAS leaf;
+    leaf.min = vec4(boundsMin, 1.0f);
+    leaf.max = vec4(boundsMax, 1.0f);
+    leaf.idx = (int)instances.size() - 1;
+    leaf.type = 0;
+    leaf.left = 0;
+    leaf.right = 0;
+    insertEntry(leaf);
+    return leaf.idx;
+}
+
+int insertSphere(const Sph& sph) {
+    spheres.push_back(sph);
+    edits.spheres.all = true;
+    TLAS leaf;
+    leaf.min = vec4(sph.center - vec3(sph.radius), 1.0f);
+    leaf.max = vec4(sph.center + vec3(sph.radius), 1.0f);
+    leaf.idx = (int)spheres.size() - 1;
+    leaf.type = 1;
+    leaf.left = 0;
+    leaf.right = 0;
+    insertEntry(leaf);
+    checkTLAS();
+    return leaf.idx;
+}
+
+// Sets the bounds of the leaf of (type, idx) below entry, found by its old
+// bounds, and refits the entries above it.
+static bool refitLeafEntry(int entry, int type, int idx, const vec3& oldMin, const vec3& oldMax,
+                           const vec3& newMin, const vec3& newMax) {
+    tlasLinked = false;
+    TLAS& e = tlas[entry];
+    if (!overlaps(vec3(e.min), vec3(e.max), oldMin, oldMax)) return false;
+    if (e.idx != -1) {
+        if (e.type != type || e.idx != idx) return false;
+        e.min = vec4(newMin, 1.0f);
+        e.max = vec4(newMax, 1.0f);
+        edited(edits.tlas, entry);
+        return true;
+    }
+    if (!refitLeafEntry(e.left, type, idx, oldMin, oldMax, newMin, newMax) &&
+        !refitLeafEntry(e.right, type, idx, oldMin, oldMax, newMin, newMax)) return false;
+    refitEntry(entry);
+    edited(edits.tlas, entry);
+    return true;
+}
+
+// Sphere BVH counterpart of dropReferences(), for the one leaf holding
+// sphereIdx. Spheres inserted after buildTLAS() aren't found, they have a
+// TLAS leaf of their own.
+static DropResult dropSphere(int idx, int sphereIdx, const vec3& boundsMin, const vec3& boundsMax) {
+    Node& node = sphereNodes[idx];
+    if (!overlaps(node.min, node.max, boundsMin, boundsMax)) return DropResult::Unchanged;
+
+    if (node.count > 0) {
+        for (int i = node.start; i < node.start + node.count; i++) {
+            if (sphereIndices[i] != sphereIdx) continue;
+            sphereIndices[i] = sphereIndices[node.start + --node.count];
+            edited(edits.sphereIndices, i);
+            edited(edits.sphereNodes, idx);
+            if (node.count == 0) return DropResult::Emptied;
+            node.min = vec3(FLT_MAX);
+            node.max = vec3(-FLT_MAX);
+            for (int k = node.start; k < node.start + node.count; k++) {
+                const Sph& sph = spheres[sphereIndices[k]];
+                node.min = min(node.min, sph.center - vec3(sph.radius));
+                node.max = max(node.max, sph.center + vec3(sph.radius));
+            }
+            return DropResult::Changed;
+        }
+        return DropResult::Unchanged;
+    }
+
+    int left = node.start;
+    DropResult l = dropSphere(left, sphereIdx, boundsMin, boundsMax);
+    DropResult r = l == DropResult::Unchanged ? dropSphere(left + 1, sphereIdx, boundsMin, boundsMax) : DropResult::Unchanged;
+    if (l == DropResult::Unchanged && r == DropResult::Unchanged) return DropResult::Unchanged;
+    if (l == DropResult::Emptied || r == DropResult::Emptied) {
+        sphereNodes[idx] = sphereNodes[l == DropResult::Emptied ? left + 1 : left];
+    } else {
+        sphereNodes[idx].min = min(sphereNodes[left].min, sphereNodes[left + 1].min);
+        sphereNodes[idx].max = max(sphereNodes[left].max, sphereNodes[left + 1].max);
+    }
+    edited(edits.sphereNodes, idx);
+    return DropResult::Changed;
+}
+
+// Points the sphere BVH reference to from at to, bounds being the sphere's bounds.
+static bool retargetSphere(int idx, int from, int to, const vec3& boundsMin, const vec3& boundsMax) {
+    const Node& node = sphereNodes[idx];
+    if (!overlaps(node.min, node.max, boundsMin, boundsMax)) return false;
+    if (node.count > 0) {
+        for (int i = node.start; i < node.start + node.count; i++) {
+            if (sphereIndices[i] != from) continue;
+            sphereIndices[i] = to;
+            edited(edits.sphereIndices, i);
+            return true;
+        }
+        return false;
+    }
+    return retargetSphere(node.start, from, to, boundsMin, boundsMax) ||
+           retargetSphere(node.start + 1, from, to, boundsMin, boundsMax);
+}
+
+void removeSphere(int sphereIdx) {
+    if (sphereIdx < 0 || sphereIdx >= (int)spheres.size()) return;
+
+    const Sph& sph = spheres[sphereIdx];
+    vec3 sphMin = sph.center - vec3(sph.radius);
+    vec3 sphMax = sph.center + vec3(sph.radius);
+    DropResult dropped = DropResult::Unchanged;
+    if (!sphereNodes.empty()) {
+        vec3 rootMin = sphereNodes[sphereRoot].min;
+        vec3 rootMax = sphereNodes[sphereRoot].max;
+        dropped = dropSphere(sphereRoot, sphereIdx, sphMin, sphMax);
+        if (dropped == DropResult::Emptied) {
+            // the last sphere of the sphere BVH went, and its TLAS leaf with it
+            sphereNodes.clear();
+            sphereIndices.clear();
+            bool emptied = false;
+            if (removeEntry(0, 2, sphereRoot, rootMin, rootMax, emptied) && emptied) {
+                tlas.clear();
+                freeTLAS.clear();
+                edits.tlas.all = true;
+            }
+        } else if (dropped == DropResult::Changed) {
+            const Node& root = sphereNodes[sphereRoot];
+            refitLeafEntry(0, 2, sphereRoot, rootMin, rootMax, root.min, root.max);
+        }
+    }
+    bool emptied = false;
+    if (dropped == DropResult::Unchanged && !tlas.empty() && removeEntry(0, 1, sphereIdx, sphMin, sphMax, emptied) && emptied) {
+        tlas.clear();
+        freeTLAS.clear();
+        edits.tlas.all = true;
+    }
+
+    // the last sphere moves into the freed index
+    int last = (int)spheres.size() - 1;
+    if (sphereIdx != last) {
+        spheres[sphereIdx] = spheres[last];
+        edited(edits.spheres, sphereIdx);
+        const Sph& moved = spheres[sphereIdx];
+        vec3 movedMin = moved.center - vec3(moved.radius);
+        vec3 movedMax = moved.center + vec3(moved.radius);
+        bool relinked = !sphereNodes.empty() && retargetSphere(sphereRoot, last, sphereIdx, movedMin, movedMax);
+        if (!relinked && !tlas.empty()) relinkEntry(0, 1, last, sphereIdx, movedMin, movedMax);
+    }
+    spheres.pop_back();
+    checkTLAS();
+}
+
+// Walks the whole TLAS since the leaves may sit outside the new mesh bounds,
+// and every instance of the mesh needs its leaf refitted.
+static bool refitMeshEntry(int entry, int meshIdx) {
+    TLAS& e = tlas[entry];
+    if (e.idx != -1) {
+        if (e.type != 0 || instances[e.idx].meshIdx != meshIdx) return false;
+        vec3 boundsMin, boundsMax;
+        instanceBounds(instances[e.idx], boundsMin, boundsMax);
+        e.min = vec4(boundsMin, 1.0f);
+        e.max = vec4(boundsMax, 1.0f);
+        edited(edits.tlas, entry);
+        return true;
+    }
+    bool left = refitMeshEntry(e.left, meshIdx);
+    bool right = refitMeshEntry(e.right, meshIdx);
+    if (!left && !right) return false;
+    refitEntry(entry);
+    edited(edits.tlas, entry);
+    return true;
+}
+
+void refitTLASEntry(int meshIdx) {
+    tlasLinked = false;
+    if (!tlas.empty()) refitMeshEntry(0, meshIdx);
+    checkTLAS();
+}
+
+void moveInstance(int instanceIdx, const mat4& toWorld) {
+    instances[instanceIdx] = makeInstance(instances[instanceIdx].meshIdx, toWorld);
+    movedInstances.push_back(instanceIdx);
+}
+
+// Makes tlasParent, instanceEntry and tlasInnerArea for the current TLAS.
+static void linkTLAS() {
+    tlasParent.assign(tlas.size(), -1);
+    instanceEntry.assign(instances.size(), -1);
+    tlasInnerArea = 0.0f;
+    std::vector<int> stack = { 0 };
+    while (!stack.empty()) {
+        int entry = stack.back();
+        stack.pop_back();
+        const TLAS& e = tlas[entry];
+        if (e.idx != -1) {
+            if (e.type == 0) instanceEntry[e.idx] = entry;
+            continue;
+        }
+        tlasInnerArea += entryArea(e);
+        tlasParent[e.left] = entry;
+        tlasParent[e.right] = entry;
+        stack.push_back(e.left);
+        stack.push_back(e.right);
+    }
+    tlasLinked = true;
+}
+
+// Refits the leaf of a moved instance and walks up from it, stopping at the
+// first entry whose box stays the same, since nothing above it changes then.
+// Appends the refitted entries to changed.
+static void refitMovedEntry(int instanceIdx, std::vector<int>& changed) {
+    int entry = instanceEntry[instanceIdx];
+    if (entry < 0) return;
+    vec3 boundsMin, boundsMax;
+    instanceBounds(instances[instanceIdx], boundsMin, boundsMax);
+    tlas[entry].min = vec4(boundsMin, 1.0f);
+    tlas[entry].max = vec4(boundsMax, 1.0f);
+    changed.push_back(entry);
+
+    for (int parent = tlasParent[entry]; parent >= 0; parent = tlasParent[parent]) {
+        TLAS& e = tlas[parent];
+        vec3 oldMin = vec3(e.min);
+        vec3 oldMax = vec3(e.max);
+        float oldArea = entryArea(e);
+        refitEntry(parent);
+        if (vec3(e.min) == oldMin && vec3(e.max) == oldMax) break;
+        tlasInnerArea += entryArea(e) - oldArea;
+        changed.push_back(parent);
+    }
+}
+
+static void collectLeaves(int entry, std::vector<TLAS>& out) {
+    const TLAS& e = tlas[entry];
+    if (e.idx != -1) {
+        out.push_back(e);
+        return;
+    }
+    collectLeaves(e.left, out);
+    collectLeaves(e.right, out);
+}
+
+TLASUpdate updateTLAS() {
+    TLASUpdate update;
+    std::sort(movedInstances.begin(), movedInstances.end());
+    movedInstances.erase(std::unique(movedInstances.begin(), movedInstances.end()), movedInstances.end());
+    update.instances.swap(movedInstances);
+    if (update.instances.empty() || tlas.empty()) return update;
+
+    if (!tlasLinked || instanceEntry.size() != instances.size()) linkTLAS();
+    for (int i : update.instances) refitMovedEntry(i, update.entries);
+
+    // the leaves keep their refitted bounds, only the entries above them are
+    // clustered again, which leaves the sphere BVH alone
+    float rootArea = entryArea(tlas[0]);
+    if (rootArea > 0.0f && tlasInnerArea > bvhSettings.refitRebuildRatio * tlasBuildCost * rootArea) {
+        BuildScope scope(0);
+        std::vector<TLAS> leaves;
+        leaves.reserve(tlas.size());
+        collectLeaves(0, leaves);
+        clusterTLAS(leaves);
+        update.rebuilt = true;
+        update.entries.clear();
+        edits.tlas = EditedEntries(); // the whole TLAS is reported as rebuilt instead
+        checkTLAS();
+        return update;
+    }
+    std::sort(update.entries.begin(), update.entries.end());
+    update.entries.erase(std::unique(update.entries.begin(), update.entries.end()), update.entries.end());
+    checkTLAS();
+    return update;
+}
+
+int maxTreeDepth() {
+    int depth = 0;
+    for (const Mesh& mesh : meshes) depth = std::max(depth, bvhDepth(mesh));
+    if (!sphereNodes.empty()) depth = std::max(depth, treeDepth(sphereNodes, sphereRoot));
+    if (tlas.empty()) return depth;
+
+    std::vector<std::pair<int, int>> stack = { { 0, 0 } };
+    while (!stack.empty()) {
+        std::pair<int, int> item = stack.back();
+        stack.pop_back();
+        depth = std::max(depth, item.second);
+        const TLAS& entry = tlas[item.first];
+        if (entry.idx != -1) continue;
+        stack.push_back({ entry.left, item.second + 1 });
+        stack.push_back({ entry.right, item.second + 1 });
+    }
+    return depth;
+}
+
+BVHEdits takeBVHEdits() {
+    BVHEdits taken;
+    std::swap(taken, edits);
+    EditedEntries* all[] = { &taken.triangles, &taken.triIndices, &taken.nodes, &taken.meshes, &taken.instances,
+                             &taken.spheres, &taken.sphereNodes, &taken.sphereIndices, &taken.tlas };
+    for (EditedEntries* entries : all) {
+        std::vector<int>& indices = entries->indices;
+        if (entries->all) indices.clear();
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    }
+    return taken;
+}
+
+// Entries an ordered traversal of a tree this deep needs on its stack.
+static int traceStackOf(int depth) {
+    return depth * (std::max(2, traceWidth()) - 1) + 1;
+}
+
+static bool contains(const vec3& outerMin, const vec3& outerMax, const vec3& innerMin, const vec3& innerMax) {
+    return outerMin.x <= innerMin.x && outerMin.y <= innerMin.y && outerMin.z <= innerMin.z &&
+           innerMax.x <= outerMax.x && innerMax.y <= outerMax.y && innerMax.z <= outerMax.z;
+}
+
+bool validateBVH(const Mesh& mesh) {
+    if (mesh.bvhRoot < 0) return true;
+    // clipped references may stick out of their leaf
+    bool splits = bvhSettings.builder == BVHBuilder::SBVH || bvhSettings.presplit;
+    int errors = 0;
+    auto report = [&](const char* what, int idx) {
+        if (errors++ < 8) std::cerr << "validateBVH: " << what << " at " << idx << " below root " << mesh.bvhRoot << "\n";
+    };
+
+    std::vector<int> referenced(mesh.triCount, 0);
+    int depth = 0;
+    int visited = 0;
+    std::vector<std::pair<int, int>> stack = { { mesh.bvhRoot, 0 } };
+    while (!stack.empty() && visited++ <= (int)nodes.size()) {
+        std::pair<int, int> item = stack.back();
+        stack.pop_back();
+        depth = std::max(depth, item.second);
+        const Node& node = nodes[item.first];
+        if (node.count > 0) {
+            if (node.start < 0 || node.start + node.count > (int)triIndices.size()) {
+                report("leaf references outside triIndices", item.first);
+                continue;
+            }
+            for (int i = node.start; i < node.start + node.count; i++) {
+                int tri = triIndices[i];
+                if (tri < mesh.triStart || tri >= mesh.triStart + mesh.triCount) {
+                    report("reference to a triangle of another mesh", i);
+                    continue;
+                }
+                referenced[tri - mesh.triStart]++;
+                const Tri& t = triangles[tri];
+                bool inside = splits ? overlaps(node.min, node.max, t.min, t.max)
+                                     : contains(node.min, node.max, t.min, t.max);
+                if (!inside) report("triangle outside its leaf", i);
+            }
+            if (node.count > Config::maxLeafCount) report("leaf too large for a quantized lane", item.first);
+            continue;
+        }
+        if (node.start < 0 || node.start + 1 >= (int)nodes.size()) {
+            report("children outside nodes", item.first);
+            continue;
+        }
+        for (int k = 0; k < 2; k++) {
+            const Node& child = nodes[node.start + k];
+            if (!contains(node.min, node.max, child.min, child.max)) report("child box outside its parent", node.start + k);
+            stack.push_back({ node.start + k, item.second + 1 });
+        }
+    }
+    if (!stack.empty()) report("cycle in the tree", mesh.bvhRoot);
+
+    for (int i = 0; i < mesh.triCount; i++) {
+        if (referenced[i] == 0) report("triangle never referenced", mesh.triStart + i);
+        else if (referenced[i] > 1 && !splits) report("triangle referenced twice", mesh.triStart + i);
+    }
+    if (traceStackOf(depth) > Config::maxTraceStack) report("tree too deep for the traversal stack", depth);
+    return errors == 0;
+}
+
+bool validateTLAS() {
+    int errors = 0;
+    auto report = [&](const char* what, int idx) {
+        if (errors++ < 8) std::cerr << "validateTLAS: " << what << " at " << idx << "\n";
+    };
+
+    std::vector<int> reachedInstances(instances.size(), 0);
+    std::vector<int> reachedSpheres(spheres.size(), 0);
+    int depth = 0;
+    if (!tlas.empty()) {
+        int visited = 0;
+        std::vector<std::pair<int, int>> stack = { { 0, 0 } };
+        while (!stack.empty() && visited++ <= (int)tlas.size()) {
+            std::pair<int, int> item = stack.back();
+            stack.pop_back();
+            depth = std::max(depth, item.second);
+            const TLAS& e = tlas[item.first];
+            if (e.idx == -1) {
+                if (e.left < 0 || e.right != e.left + 1 || e.right >= (int)tlas.size()) {
+                    report("children not next to each other", item.first);
+                    continue;
+                }
+                for (int child : { e.left, e.right }) {
+                    const TLAS& c = tlas[child];
+                    if (!contains(vec3(e.min), vec3(e.max), vec3(c.min), vec3(c.max))) report("child box outside its parent", child);
+                    stack.push_back({ child, item.second + 1 });
+                }
+            } else if (e.type == 0 && e.idx < (int)instances.size()) {
+                reachedInstances[e.idx]++;
+            } else if (e.type == 1 && e.idx < (int)spheres.size()) {
+                reachedSpheres[e.idx]++;
+            } else if (e.type == 2 && !sphereNodes.empty()) {
+                const Node& root = sphereNodes[sphereRoot];
+                if (!contains(vec3(e.min), vec3(e.max), root.min, root.max)) report("sphere BVH outside its leaf", item.first);
+            } else {
+                report("leaf of an unknown primitive", item.first);
+            }
+        }
+        if (!stack.empty()) report("cycle in the TLAS", 0);
+    }
+
+    if (!sphereNodes.empty()) {
+        int visited = 0;
+        std::vector<std::pair<int, int>> stack = { { sphereRoot, 0 } };
+        while (!stack.empty() && visited++ <= (int)sphereNodes.size()) {
+            std::pair<int, int> item = stack.back();
+            stack.pop_back();
+            depth = std::max(depth, item.second);
+            const Node& node = sphereNodes[item.first];
+            if (node.count > 0) {
+                for (int i = node.start; i < node.start + node.count; i++) {
+                    int s = sphereIndices[i];
+                    if (s < 0 || s >= (int)spheres.size()) {
+                        report("reference outside spheres", i);
+                        continue;
+                    }
+                    reachedSpheres[s]++;
+                    vec3 r(spheres[s].radius);
+                    if (!contains(node.min, node.max, spheres[s].center - r, spheres[s].center + r)) report("sphere outside its leaf", i);
+                }
+                continue;
+            }
+            for (int k = 0; k < 2; k++) {
+                const Node& child = sphereNodes[node.start + k];
+                if (!contains(node.min, node.max, child.min, child.max)) report("child box outside its parent in the sphere BVH", node.start + k);
+                stack.push_back({ node.start + k, item.second + 1 });
+            }
+        }
+    }
+
+    for (int i = 0; i < (int)instances.size(); i++) {
+        bool hasBVH = meshes[instances[i].meshIdx].bvhRoot >= 0;
+        if (reachedInstances[i] != (hasBVH ? 1 : 0)) report("instance not reached once", i);
+    }
+    for (int i = 0; i < (int)spheres.size(); i++) {
+        if (reachedSpheres[i] != 1) report("sphere not reached once", i);
+    }
+    if (traceStackOf(depth) > Config::maxTraceStack) report("tree too deep for the traversal stack", depth);
+    return errors == 0;
+}
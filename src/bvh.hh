@@ -4,8 +4,210 @@
 #include <glm/glm.hpp>
 #include <structs.hh>
 
+struct BVHSettings {
+    BVHBuilder builder = Config::bvhBuilder;
+    int bins = Config::sahBins;
+    float traversalCost = Config::traversalCost;
+    float intersectionCost = Config::intersectionCost;
+    int maxLeafSize = Config::maxLeafSize;
+    int mortonBits = Config::mortonBits;
+    int lbvhTreeletSize = Config::lbvhTreeletSize;
+    int plocRadius = Config::plocRadius;
+    float sbvhBudget = Config::sbvhBudget;
+    float refitRebuildRatio = Config::refitRebuildRatio;
+    bool presplit = Config::presplit;
+    float presplitBudget = Config::presplitBudget;
+    bool optimize = Config::optimizeBVH;
+    int treeletSize = Config::treeletSize;
+    int optimizePasses = Config::optimizePasses;
+    int width = Config::bvhWidth;
+    bool compress = Config::compressBVH;
+    bool reorder = Config::reorderTriangles;
+    BVHLayout layout = Config::bvhLayout;
+    float cameraWeight = Config::cameraWeight;
+    bool cache = Config::bvhCache;
+    bool parallel = Config::parallelBVH;
+    bool validate = Config::validateBVH;
+};
+
+extern BVHSettings bvhSettings;
+
+// Both builds, and rebuildAllBVHs(), may first split the triangles with the
+// most wasted box area into pieces (see presplit). Each piece becomes a leaf
+// reference to its triangle, so triangles and mesh.triCount stay as they are.
 void buildBVH(Mesh& mesh);
 
+// Builds the meshes concurrently into disjoint node ranges, which end up
+// packed in mesh order behind the nodes already in use.
 void buildBVHs(std::vector<Mesh>& meshes);
 
-void buildTLAS();
\ No newline at end of file
+// Appends count nodes of a tree built earlier (see bvhcache.hh) on a root
+// aligned slot. Inner node starts are relative to the first node, leaf starts
+// to refOffset in triIndices. Returns the index the first node landed on.
+int appendBVH(const Node* src, int count, int refOffset);
+
+// Drops every node and triangle reference and builds the BVHs of meshes again
+// from their current triangles, e.g. after setBuildCamera(). meshes must hold
+// every mesh with a BVH, in the order instances refer to them; their roots move.
+void rebuildAllBVHs(std::vector<Mesh>& meshes);
+
+// Rebuilds the BVH of mesh from its current triangles, presplitting them again
+// when bvhSettings.presplit is set, and reuses its node slots and triIndices
+// range instead of appending a new tree where it fits.
+void rebuildBVH(Mesh& mesh);
+
+// Recomputes node bounds bottom-up after the triangles of mesh moved. Rebuilds
+// instead, and returns true, once the SAH cost grew past refitRebuildRatio
+// times that of a refit right after the last build.
+bool refitBVH(Mesh& mesh);
+
+// Adds tri, given in the mesh's object space, to mesh and to its BVH without
+// a rebuild and returns its index in triangles. The mesh's triangles and
+// references move to the end of their arrays when they have no spare slot left.
+int insertTriangle(Mesh& mesh, const Tri& tri);
+
+// Removes triangle triIdx of mesh from its BVH and its triangle range, moving
+// the mesh's last triangle into the freed slot. The last triangle of a mesh
+// can't be removed.
+bool removeTriangle(Mesh& mesh, int triIdx);
+
+// Lowers the SAH cost of an already built tree by restructuring treelets of
+// up to treeletSize nodes into their optimal topology, optimizePasses times.
+void optimizeBVH(Mesh& mesh);
+
+// Permutes triangles into the leaf order of all mesh BVHs and updates each
+// mesh's triangle range. Triangles referenced from several leaves (spatial
+// splits) are duplicated. Afterwards triIndices is the identity, so leaves
+// can index triangles directly.
+void reorderTriangles();
+
+float computeSAH(const Mesh& mesh);
+
+// Levels from the root of mesh's BVH down to its deepest leaf. An ordered
+// binary traversal needs a stack of one entry more.
+int bvhDepth(const Mesh& mesh);
+
+// Deepest of bvhDepth() over meshes, the sphere BVH and the TLAS.
+int maxTreeDepth();
+
+// Checks the BVH of mesh: every child box inside its parent, every triangle
+// of the mesh referenced by a leaf whose box holds it (overlaps it for
+// spatial splits and presplits), and a depth the traversal stacks can take.
+// Reports what it finds to std::cerr and returns false then. While validate
+// is set (--validate), builds and edits run it on every tree they touch.
+bool validateBVH(const Mesh& mesh);
+
+// The same for the TLAS and the sphere BVH: children next to each other and
+// inside their parent, every instance with a BVH and every sphere reached once.
+// insertInstance() doesn't run it, scenes place their instances before the
+// buildTLAS() that takes in their spheres.
+bool validateTLAS();
+
+// Reorders the child pairs of mesh's BVH in memory, reusing the slots it
+// already occupies. The root keeps its index. Rebuilds go back to build order.
+void layoutBVH(Mesh& mesh, BVHLayout layout);
+
+float area(vec3 minv, vec3 maxv);
+
+// While a build camera is set and cameraWeight is above 0, builds, treelet
+// optimization and buildTLAS() weight the SAH by how much of the screen a box
+// covers from cam, mixed with the surface area for the rays bouncing around
+// the scene bounds. Mesh BVHs are weighted as placed by their first instance.
+// computeSAH() keeps measuring the plain SAH.
+void setBuildCamera(const Camera& cam, const vec3& sceneMin, const vec3& sceneMax);
+void clearBuildCamera();
+bool hasBuildCamera();
+
+// True once cam moved or turned far enough from the build camera that the
+// trees should be rebuilt for it (see cameraRebuildDistance and cameraRebuildAngle).
+bool buildCameraMoved(const Camera& cam);
+
+// Area of the part of tri inside the box.
+float clippedTriangleArea(const Tri& tri, const vec3& boxMin, const vec3& boxMax);
+
+// Node width the traversal uses: bvhSettings.width, and at least 4 when the
+// nodes are compressed.
+int traceWidth();
+
+// Collapses the binary BVH of mesh into width-wide nodes (4 or 8) appended to
+// wideNodes and returns the index of the root's first block.
+int collapseBVH(const Mesh& mesh, int width);
+
+// Rebuilds quantizedNodes from wideNodes block for block, so wide roots and
+// child indices stay valid. Decoded bounds always contain the original ones.
+void quantizeWideBVH();
+
+WideNode decodeQuantizedNode(const QuantizedNode& node);
+
+// An instance of meshes[meshIdx] placed by toWorld, which may be any affine
+// transform. Traversal moves rays into object space with the stored inverse
+// rather than normalizing their direction, so hit distances stay world distances.
+Instance makeInstance(int meshIdx, const mat4& toWorld);
+mat4 instanceToWorld(const Instance& inst);
+
+// World space bounds of the instance's mesh root box.
+void instanceBounds(const Instance& inst, vec3& outMin, vec3& outMax);
+
+// Bounds of every instance and sphere.
+void sceneBounds(vec3& outMin, vec3& outMax);
+
+// Clusters the instances and spheres bottom up with the PLOC clustering, the
+// root ends up at tlas[0] and the children of every entry next to each other,
+// which the incremental updates keep. Above sphereBVHMin spheres, they are
+// clustered into sphereNodes instead, below a single leaf of type 2.
+void buildTLAS();
+
+// Adds an instance of meshes[meshIdx] together with its TLAS leaf and returns
+// its index in instances.
+int insertInstance(int meshIdx, const mat4& toWorld);
+
+// Add or remove a sphere together with its TLAS leaf, or its reference in the
+// sphere BVH. Removing moves the last sphere into the freed index.
+int insertSphere(const Sph& sph);
+void removeSphere(int sphereIdx);
+
+// Replaces the transform of instances[instanceIdx]. Its TLAS leaf follows on
+// the next updateTLAS().
+void moveInstance(int instanceIdx, const mat4& toWorld);
+
+struct TLASUpdate {
+    bool rebuilt = false;       // every entry changed and tlas may have changed size
+    std::vector<int> entries;   // refitted tlas entries, ascending, unless rebuilt
+    std::vector<int> instances; // moved instances, ascending
+};
+
+// Refits the TLAS leaves of the instances moved since the last call and the
+// entries above them. Once the TLAS cost grew past refitRebuildRatio times
+// its value after the last clustering, the entries above the leaves are
+// clustered again instead. Reports what changed, for partial uploads.
+TLASUpdate updateTLAS();
+
+// Refits the TLAS leaves of every instance of meshes[meshIdx] and their
+// ancestors to the mesh's current root bounds, e.g. after insertTriangle() or
+// removeTriangle().
+void refitTLASEntry(int meshIdx);
+
+// Elements of one array written since the last takeBVHEdits(), ascending, or
+// all of them once the array changed size.
+struct EditedEntries {
+    bool all = false;
+    std::vector<int> indices;
+};
+
+// What insertTriangle(), removeTriangle(), insertInstance(), insertSphere(),
+// removeSphere() and refitTLASEntry() changed, for partial uploads like
+// TLASUpdate. Rebuilds inside them count as all changed.
+struct BVHEdits {
+    EditedEntries triangles;
+    EditedEntries triIndices;
+    EditedEntries nodes;
+    EditedEntries meshes;
+    EditedEntries instances;
+    EditedEntries spheres;
+    EditedEntries sphereNodes;
+    EditedEntries sphereIndices;
+    EditedEntries tlas;
+};
+
+// Returns the edits since the last call and starts collecting anew.
+BVHEdits takeBVHEdits();
@@ -0,0 +1,238 @@
+#include <glm/glm.hpp>
+#include <structs.hh>
+#include <bvh.hh>
+#include <bvhcache.hh>
+#include <utilities.hh>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bump whenever the build or the file layout changes in a way the key does
+// not capture, so stale caches are rebuilt instead of loaded.
+static const uint32_t cacheVersion = 1;
+static const char cacheMagic[4] = { 'B', 'V', 'H', 'C' };
+
+// The file holds the header followed by the Mesh, Tri, Node and reference
+// arrays. Meshes and nodes index relative to the start of their batch, so a
+// cache can be loaded behind any amount of other geometry.
+struct CacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    int32_t meshCount;
+    int32_t triCount;
+    int32_t nodeCount;
+    int32_t refCount;
+};
+
+// Read only view of a whole file, empty when it can't be opened.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = static_cast<const char*>(mapped);
+                size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+    ~MappedFile() {
+        if (data) munmap(const_cast<char*>(data), size);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+// 64-bit FNV-1a
+static uint64_t hashBytes(uint64_t hash, const void* bytes, size_t count) {
+    const unsigned char* p = static_cast<const unsigned char*>(bytes);
+    for (size_t i = 0; i < count; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+template <typename T>
+static uint64_t hashValue(uint64_t hash, const T& value) {
+    return hashBytes(hash, &value, sizeof(T));
+}
+
+// The materials of the cached meshes and triangles: what every usemtl name
+// resolves to through materialMap, and the contents of the .mtl files named
+// by mtllib, looked up next to the OBJ.
+static uint64_t hashMaterials(uint64_t hash, const std::string& path, const MappedFile& obj) {
+    std::string dir = path.substr(0, path.find_last_of('/') + 1);
+    size_t pos = 0;
+    while (pos < obj.size) {
+        const char* line = obj.data + pos;
+        const char* end = static_cast<const char*>(memchr(line, '\n', obj.size - pos));
+        size_t length = end ? end - line : obj.size - pos;
+        pos += length + 1;
+        bool usemtl = length > 6 && strncmp(line, "usemtl", 6) == 0;
+        bool mtllib = length > 6 && strncmp(line, "mtllib", 6) == 0;
+        if (!usemtl && !mtllib) continue;
+
+        std::istringstream s(std::string(line + 6, length - 6));
+        std::string name;
+        s >> name;
+        hash = hashBytes(hash, name.data(), name.size());
+        if (usemtl) {
+            auto it = materialMap.find(name);
+            hash = hashValue(hash, it != materialMap.end() ? it->second : -1);
+        } else {
+            MappedFile mtl(dir + name);
+            if (mtl.data) hash = hashBytes(hash, mtl.data, mtl.size);
+        }
+    }
+    return hash;
+}
+
+// Everything the built triangles and nodes depend on. Returns 0 when the OBJ
+// can't be read, which disables caching for it.
+static uint64_t cacheKey(const std::string& path, const mat4& transform) {
+    MappedFile obj(path);
+    if (!obj.data) return 0;
+
+    uint64_t hash = 14695981039346656037ull;
+    hash = hashValue(hash, cacheVersion);
+    hash = hashBytes(hash, obj.data, obj.size);
+    hash = hashMaterials(hash, path, obj);
+    for (int c = 0; c < 4; c++) hash = hashValue(hash, vec4(transform[c]));
+    hash = hashValue(hash, bvhSettings.builder);
+    hash = hashValue(hash, bvhSettings.bins);
+    hash = hashValue(hash, bvhSettings.traversalCost);
+    hash = hashValue(hash, bvhSettings.intersectionCost);
+    hash = hashValue(hash, bvhSettings.maxLeafSize);
+    hash = hashValue(hash, bvhSettings.mortonBits);
+    hash = hashValue(hash, bvhSettings.lbvhTreeletSize);
+    hash = hashValue(hash, bvhSettings.plocRadius);
+    hash = hashValue(hash, bvhSettings.sbvhBudget);
+    hash = hashValue(hash, bvhSettings.presplit);
+    hash = hashValue(hash, bvhSettings.presplitBudget);
+    hash = hashValue(hash, int(Config::maxBVHDepth));
+    hash = hashValue(hash, int(Config::minVolumeAmount));
+    hash = hashValue(hash, Config::sbvhAlpha);
+    return hash ? hash : 1;
+}
+
+static std::string cachePath(uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bvh", (unsigned long long)key);
+    return std::string(Config::bvhCacheDir) + name;
+}
+
+static bool readCache(const std::string& path, uint64_t key, std::vector<Mesh>& out) {
+    MappedFile file(path);
+    if (!file.data || file.size < sizeof(CacheHeader)) return false;
+
+    CacheHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    size_t expected = sizeof(CacheHeader) + header.meshCount * sizeof(Mesh) + header.triCount * sizeof(Tri) +
+                      header.nodeCount * sizeof(Node) + header.refCount * sizeof(int);
+    if (memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != cacheVersion ||
+        header.key != key || header.meshCount <= 0 || header.nodeCount <= 0 || file.size != expected) {
+        return false;
+    }
+
+    const char* p = file.data + sizeof(CacheHeader);
+    const Mesh* cachedMeshes = reinterpret_cast<const Mesh*>(p);
+    p += header.meshCount * sizeof(Mesh);
+    const Tri* cachedTris = reinterpret_cast<const Tri*>(p);
+    p += header.triCount * sizeof(Tri);
+    const Node* cachedNodes = reinterpret_cast<const Node*>(p);
+    p += header.nodeCount * sizeof(Node);
+    const int* cachedRefs = reinterpret_cast<const int*>(p);
+
+    int triOffset = (int)triangles.size();
+    triangles.insert(triangles.end(), cachedTris, cachedTris + header.triCount);
+    int refOffset = (int)triIndices.size();
+    triIndices.resize(refOffset + header.refCount);
+    for (int i = 0; i < header.refCount; i++) triIndices[refOffset + i] = cachedRefs[i] + triOffset;
+    int nodeOffset = appendBVH(cachedNodes, header.nodeCount, refOffset);
+
+    out.assign(cachedMeshes, cachedMeshes + header.meshCount);
+    for (Mesh& mesh : out) {
+        mesh.triStart += triOffset;
+        mesh.bvhRoot += nodeOffset;
+    }
+    return true;
+}
+
+// Writes the batch built from triBase, refBase and the first mesh's root on,
+// which buildBVHs() appended to the end of each global array.
+static void writeCache(const std::string& path, uint64_t key, const std::vector<Mesh>& built, int triBase, int refBase) {
+    int nodeBase = built.front().bvhRoot;
+    std::vector<Mesh> relMeshes = built;
+    for (Mesh& mesh : relMeshes) {
+        mesh.triStart -= triBase;
+        mesh.bvhRoot -= nodeBase;
+    }
+    std::vector<Node> relNodes(nodes.begin() + nodeBase, nodes.end());
+    for (Node& node : relNodes) node.start -= node.count > 0 ? refBase : nodeBase;
+    std::vector<int> relRefs(triIndices.begin() + refBase, triIndices.end());
+    for (int& ref : relRefs) ref -= triBase;
+
+    CacheHeader header;
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version = cacheVersion;
+    header.key = key;
+    header.meshCount = (int32_t)relMeshes.size();
+    header.triCount = (int32_t)triangles.size() - triBase;
+    header.nodeCount = (int32_t)relNodes.size();
+    header.refCount = (int32_t)relRefs.size();
+
+    // write to a temporary name first so an interrupted run never leaves a
+    // truncated file behind under the real one
+    mkdir(Config::bvhCacheDir, 0755);
+    std::string tmpPath = path + ".tmp";
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (!f) return;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(relMeshes.data(), sizeof(Mesh), relMeshes.size(), f) == relMeshes.size();
+    ok = ok && fwrite(triangles.data() + triBase, sizeof(Tri), header.triCount, f) == (size_t)header.triCount;
+    ok = ok && fwrite(relNodes.data(), sizeof(Node), relNodes.size(), f) == relNodes.size();
+    ok = ok && fwrite(relRefs.data(), sizeof(int), relRefs.size(), f) == relRefs.size();
+    ok = fclose(f) == 0 && ok;
+    if (ok) ok = rename(tmpPath.c_str(), path.c_str()) == 0;
+    if (!ok) remove(tmpPath.c_str());
+}
+
+std::vector<Mesh> loadCachedObject(const std::string& path, const mat4& transform) {
+    // camera-weighted trees only suit one viewpoint, so they are never stored
+    uint64_t key = bvhSettings.cache && !hasBuildCamera() ? cacheKey(path, transform) : 0;
+    std::vector<Mesh> result;
+    if (key && readCache(cachePath(key), key, result)) {
+        std::cout << "BVH cache: loaded " << path << " from " << cachePath(key) << "\n";
+        if (bvhSettings.validate) {
+            for (const Mesh& mesh : result) validateBVH(mesh);
+        }
+        return result;
+    }
+
+    int triBase = (int)triangles.size();
+    int refBase = (int)triIndices.size();
+    result = createObjectFromFile(path);
+    ::transform(result, transform);
+    buildBVHs(result);
+    if (key && !result.empty()) writeCache(cachePath(key), key, result, triBase, refBase);
+    return result;
+}
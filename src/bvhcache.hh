@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include <structs.hh>
+
+// Loads the OBJ at path, applies transform and builds the BVHs of its meshes,
+// like createObjectFromFile(), transform() and buildBVHs() in a row. The
+// result is stored in bvhCacheDir under a hash of the file contents, the
+// transform and the build settings, and later runs with the same key map that
+// file instead of parsing and building again. The meshes are not added to
+// the global meshes list.
+std::vector<Mesh> loadCachedObject(const std::string& path, const mat4& transform);
@@ -8,6 +8,8 @@
 #include <utilities.hh>
 #include <structs.hh>
 #include <bvh.hh>
+#include <bvhcache.hh>
+#include <analysis.hh>
 
 #include <unordered_map>
 #include <algorithm>
@@ -16,6 +18,9 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <cstdlib>
+#include <cfloat>
+#include <climits>
 
 using namespace glm;
 using namespace std;
@@ -23,28 +28,34 @@ using namespace std;
 int WIDTH = Config::width;
 int HEIGHT = Config::height;
 
+// First mesh and mesh count of every OBJ loaded so far.
+static unordered_map<string, pair<int, int>> loadedObjects;
+
+// Places the meshes of the OBJ at path with transform. Each file is loaded
+// and built once in object space, placing it again only adds instances.
+static void place_object(const string& path, const mat4& transform) {
+    auto it = loadedObjects.find(path);
+    if (it == loadedObjects.end()) {
+        vector<Mesh> loaded = loadCachedObject(path, mat4(1.0f));
+        it = loadedObjects.emplace(path, make_pair((int)meshes.size(), (int)loaded.size())).first;
+        meshes.insert(meshes.end(), loaded.begin(), loaded.end());
+    }
+    for (int m = it->second.first; m < it->second.first + it->second.second; m++) insertInstance(m, transform);
+}
+
 void generate_scene() {
-    vector<Mesh> suz = createObjectFromFile("../models/suzanne.obj");
     mat4 suzTransform = get_translation(vec3(-1.75f, 1.8f, 0.0f)) *
                         get_rotation_y(radians(10.0f)) *
                         get_rotation_x(radians(-30.0f));
-    transform(suz, suzTransform);
-    buildBVHs(suz);
-    meshes.insert(meshes.end(), suz.begin(), suz.end());
+    place_object("../models/suzanne.obj", suzTransform);
 
-    vector<Mesh> box = createObjectFromFile("../models/cornell-box.obj");
     mat4 boxTransform = get_translation(vec3(0.4f, -5.0f, 8.0f)) *
                         get_scaling(2.0f);
-    transform(box, boxTransform);
-    buildBVHs(box);
-    meshes.insert(meshes.end(), box.begin(), box.end());
+    place_object("../models/cornell-box.obj", boxTransform);
 
-    vector<Mesh> spot = createObjectFromFile("../models/spot.obj");
     mat4 spotTransform = get_translation(vec3(1.2f, -1.3f, 4.2f)) *
                         get_rotation_y(radians(130.0f));
-    transform(spot, spotTransform);
-    buildBVHs(spot);
-    meshes.insert(meshes.end(), spot.begin(), spot.end());
+    place_object("../models/spot.obj", spotTransform);
 
     const float s = 5.0f;
     const float ts = 1.0f;
@@ -64,7 +75,6 @@ void generate_scene() {
         tri.normal = normalize(cross(tri.v1 - tri.v0, tri.v2 - tri.v0));
         tri.materialIdx = 2;
         triangles.push_back(tri);
-        triIndices.push_back(static_cast<int>(triangles.size() - 1));
         Sph sph;
         sph.center = vec3(rnd(-s, s), rnd(-s, s), rnd(-s, s));
         sph.radius = rnd(0.1f, 0.8f);
@@ -78,47 +88,219 @@ void generate_scene() {
     randomMesh.bvhRoot = -1;
     buildBVH(randomMesh);
     meshes.push_back(randomMesh);
+    insertInstance((int)meshes.size() - 1, mat4(1.0f));
 }
 
+// quantized nodes only exist for the wide layout
 static inline float toFloat(int v) {
     float f;
     memcpy(&f, &v, sizeof(float));
     return f;
 }
 
-void init(GLuint triSSBO, GLuint sphSSBO, GLuint bvhSSBO, 
-        GLuint triIndSSBO, GLuint meshSSBO, GLuint tlasSSBO, GLuint materialSSBO) {
-    generate_scene();
+// Rebuilds every mesh BVH with the SAH weighted towards what cam sees.
+static void build_for_camera(const Camera& cam) {
+    vec3 sceneMin, sceneMax;
+    sceneBounds(sceneMin, sceneMax);
+    setBuildCamera(cam, sceneMin, sceneMax);
+    rebuildAllBVHs(meshes);
+}
+
+// Passes over the built mesh BVHs, then the TLAS over them.
+static void finish_scene() {
+    if (bvhSettings.optimize) {
+        float before = 0.0f;
+        float after = 0.0f;
+        for (Mesh& mesh : meshes) {
+            before += computeSAH(mesh);
+            optimizeBVH(mesh);
+            after += computeSAH(mesh);
+        }
+        cout << "BVH optimization: SAH cost " << before << " -> " << after << "\n";
+    }
+    for (Mesh& mesh : meshes) layoutBVH(mesh, bvhSettings.layout);
+    if (bvhSettings.reorder) reorderTriangles();
     buildTLAS();
+}
+
+void build_scene(const Camera& cam) {
+    generate_scene();
+    if (bvhSettings.cameraWeight > 0.0f) build_for_camera(cam);
+    finish_scene();
+}
+
+static GPUTri gpu_tri(const Tri& tri) {
+    vec3 e1 = tri.v1 - tri.v0;
+    vec3 e2 = tri.v2 - tri.v0;
+
+    GPUTri gtri;
+    gtri.data0 = vec4(tri.v0, e1.x);
+    gtri.data1 = vec4(e1.y, e1.z, e2.x, e2.y);
+    gtri.data2 = vec4(e2.z, tri.normal);
+    return gtri;
+}
+
+static GPUSph gpu_sph(const Sph& sph) {
+    GPUSph gsph;
+    gsph.data0 = vec4(sph.center, sph.radius);
+    return gsph;
+}
+
+static GPUNode gpu_node(const Node& node) {
+    GPUNode gnode;
+    gnode.data0 = vec4(node.min, toFloat(node.start));
+    gnode.data1 = vec4(node.max, toFloat(node.count));
+    return gnode;
+}
 
+static GPUTLAS gpu_tlas_entry(const TLAS& entry) {
+    GPUTLAS gentry;
+    gentry.data0 = vec4(vec3(entry.min), toFloat(entry.idx == -1 ? entry.left : entry.idx));
+    gentry.data1 = vec4(vec3(entry.max), toFloat(entry.type));
+    return gentry;
+}
+
+static vector<GPUTri> gpu_tris() {
     vector<GPUTri> gpuTris;
-    for (Tri& tri : triangles) {
-        vec3 e1 = tri.v1 - tri.v0;
-        vec3 e2 = tri.v2 - tri.v0;
-
-        GPUTri gtri;
-        gtri.data0 = vec4(tri.v0, e1.x);
-        gtri.data1 = vec4(e1.y, e1.z, e2.x, e2.y);
-        gtri.data2 = vec4(e2.z, tri.normal);
-        gpuTris.push_back(gtri);
-    }
+    gpuTris.reserve(triangles.size());
+    for (const Tri& tri : triangles) gpuTris.push_back(gpu_tri(tri));
+    return gpuTris;
+}
 
+static vector<GPUSph> gpu_sphs() {
     vector<GPUSph> gpuSphs;
-    for (Sph& sph : spheres) {
-        GPUSph gsph;
-        gsph.data0 = vec4(sph.center, sph.radius);
-        gpuSphs.push_back(gsph);
+    gpuSphs.reserve(spheres.size());
+    for (const Sph& sph : spheres) gpuSphs.push_back(gpu_sph(sph));
+    return gpuSphs;
+}
+
+static vector<GPUNode> gpu_nodes(const vector<Node>& src) {
+    vector<GPUNode> gpuNodes;
+    gpuNodes.reserve(src.size());
+    for (const Node& node : src) gpuNodes.push_back(gpu_node(node));
+    return gpuNodes;
+}
+
+static vector<GPUTLAS> gpu_tlas() {
+    vector<GPUTLAS> gpuTLAS;
+    gpuTLAS.reserve(tlas.size());
+    for (const TLAS& entry : tlas) gpuTLAS.push_back(gpu_tlas_entry(entry));
+    return gpuTLAS;
+}
+
+// the shader walks the collapsed tree instead, so its meshes point at wide roots
+static vector<Mesh> gpu_meshes() {
+    vector<Mesh> gpuMeshes = meshes;
+    if (traceWidth() > 2) {
+        wideNodes.clear();
+        for (Mesh& mesh : gpuMeshes) mesh.bvhRoot = collapseBVH(mesh, traceWidth());
+        if (bvhSettings.compress) quantizeWideBVH();
     }
+    return gpuMeshes;
+}
 
+// Rebuilds the BVHs for cam and uploads the mesh trees.
+static void rebuild_for_camera(const Camera& cam, GLuint& bvhSSBO, GLuint& triIndSSBO, GLuint& meshSSBO,
+                               GLuint& wideSSBO) {
+    double start = glfwGetTime();
+    build_for_camera(cam);
+    finish_scene();
+
+    updateSSBO<GPUNode>(bvhSSBO, gpu_nodes(nodes));
+    updateSSBO<int>(triIndSSBO, triIndices);
+    updateSSBO<Mesh>(meshSSBO, gpu_meshes());
+    if (bvhSettings.compress) updateSSBO<QuantizedNode>(wideSSBO, quantizedNodes);
+    else if (traceWidth() > 2) updateSSBO<WideNode>(wideSSBO, wideNodes);
+    // buildTLAS() reports the TLAS and the sphere BVH, which it weights by the
+    // camera as well, as edited, so upload_bvh_edits() uploads them
+    cout << "Camera BVH rebuild: " << (glfwGetTime() - start) * 1000.0 << " ms\n";
+}
 
-    vector<GPUNode> gpuNodes;
-    for (Node& node : nodes) {
-        GPUNode gnode;
-        gnode.data0 = vec4(node.min, toFloat(node.start));
-        gnode.data1 = vec4(node.max, toFloat(node.count));
-        gpuNodes.push_back(gnode);
+// Traversal stack entries the shader needs for the deepest tree: an ordered
+// traversal keeps at most width - 1 entries per level plus the one popped.
+static int trace_stack_size() {
+    return std::max(64, maxTreeDepth() * (traceWidth() - 1) + 2);
+}
+
+// Compiles the trace shader, again whenever the trees outgrew its stack.
+static void update_trace_program(GLuint& program, int& stackSize) {
+    int needed = trace_stack_size();
+    if (program && needed <= stackSize) return;
+    if (program) glDeleteProgram(program);
+    stackSize = needed;
+    program = createProgram("../shaders/trace.glsl",
+        "#define BVH_WIDTH " + to_string(traceWidth()) + "\n#define BVH_QUANTIZED " + to_string(int(bvhSettings.compress)) +
+        "\n#define TRIS_IN_LEAF_ORDER " + to_string(int(bvhSettings.reorder)) + "\n#define STACK_SIZE " + to_string(stackSize));
+}
+
+// Spins every instance about the y axis of its object, starting from the
+// transform it was placed with.
+static void animate_instances(const vector<mat4>& placed, float time) {
+    for (int i = 0; i < (int)instances.size(); i++) moveInstance(i, placed[i] * get_rotation_y(time * 0.5f));
+}
+
+// Uploads the moved instances and what updateTLAS() changed: the refitted
+// entries only, or the whole TLAS after it was clustered again.
+static void upload_tlas_update(const TLASUpdate& update, GLuint& tlasSSBO, GLuint& instanceSSBO) {
+    updateSSBOEntries<Instance>(instanceSSBO, instances, update.instances);
+    if (update.rebuilt) updateSSBO<GPUTLAS>(tlasSSBO, gpu_tlas());
+    else updateSSBOEntries<GPUTLAS>(tlasSSBO, tlas, update.entries, gpu_tlas_entry);
+}
+
+// Uploads what the edit functions of bvh.hh changed since the last call,
+// entry by entry where the array kept its size. Returns whether anything did.
+static bool upload_bvh_edits(GLuint& triSSBO, GLuint& sphSSBO, GLuint& bvhSSBO, GLuint& triIndSSBO, GLuint& meshSSBO,
+                             GLuint& tlasSSBO, GLuint& wideSSBO, GLuint& instanceSSBO, GLuint& sphereBVHSSBO,
+                             GLuint& sphereIndSSBO) {
+    BVHEdits edits = takeBVHEdits();
+    auto changed = [](const EditedEntries& e) { return e.all || !e.indices.empty(); };
+    bool meshesChanged = changed(edits.triangles) || changed(edits.triIndices) || changed(edits.nodes) || changed(edits.meshes);
+    if (!meshesChanged && !changed(edits.instances) && !changed(edits.spheres) && !changed(edits.sphereNodes) &&
+        !changed(edits.sphereIndices) && !changed(edits.tlas)) return false;
+
+    if (meshesChanged && bvhSettings.reorder) {
+        // leaves index triangles directly, so the edited meshes are laid out again
+        reorderTriangles();
+        updateSSBO<GPUTri>(triSSBO, gpu_tris());
+        updateSSBO<GPUNode>(bvhSSBO, gpu_nodes(nodes));
+        updateSSBO<Mesh>(meshSSBO, gpu_meshes());
+    } else if (meshesChanged) {
+        if (edits.triangles.all) updateSSBO<GPUTri>(triSSBO, gpu_tris());
+        else updateSSBOEntries<GPUTri>(triSSBO, triangles, edits.triangles.indices, gpu_tri);
+        if (edits.triIndices.all) updateSSBO<int>(triIndSSBO, triIndices);
+        else updateSSBOEntries<int>(triIndSSBO, triIndices, edits.triIndices.indices);
+        if (edits.nodes.all) updateSSBO<GPUNode>(bvhSSBO, gpu_nodes(nodes));
+        else updateSSBOEntries<GPUNode>(bvhSSBO, nodes, edits.nodes.indices, gpu_node);
+        // the wide trees are collapsed again from the edited binary ones
+        updateSSBO<Mesh>(meshSSBO, gpu_meshes());
+        if (bvhSettings.compress) updateSSBO<QuantizedNode>(wideSSBO, quantizedNodes);
+        else if (traceWidth() > 2) updateSSBO<WideNode>(wideSSBO, wideNodes);
     }
 
+    if (edits.instances.all) updateSSBO<Instance>(instanceSSBO, instances);
+    else updateSSBOEntries<Instance>(instanceSSBO, instances, edits.instances.indices);
+    if (edits.spheres.all) updateSSBO<GPUSph>(sphSSBO, gpu_sphs());
+    else updateSSBOEntries<GPUSph>(sphSSBO, spheres, edits.spheres.indices, gpu_sph);
+    if (edits.sphereNodes.all) updateSSBO<GPUNode>(sphereBVHSSBO, gpu_nodes(sphereNodes));
+    else updateSSBOEntries<GPUNode>(sphereBVHSSBO, sphereNodes, edits.sphereNodes.indices, gpu_node);
+    if (edits.sphereIndices.all) updateSSBO<int>(sphereIndSSBO, sphereIndices);
+    else updateSSBOEntries<int>(sphereIndSSBO, sphereIndices, edits.sphereIndices.indices);
+    if (edits.tlas.all) updateSSBO<GPUTLAS>(tlasSSBO, gpu_tlas());
+    else updateSSBOEntries<GPUTLAS>(tlasSSBO, tlas, edits.tlas.indices, gpu_tlas_entry);
+    return true;
+}
+
+void init(const Camera& cam, GLuint& triSSBO, GLuint& sphSSBO, GLuint& bvhSSBO, GLuint& triIndSSBO, GLuint& meshSSBO,
+        GLuint& tlasSSBO, GLuint& materialSSBO, GLuint& wideSSBO, GLuint& instanceSSBO, GLuint& sphereBVHSSBO,
+        GLuint& sphereIndSSBO) {
+    build_scene(cam);
+    takeBVHEdits(); // everything is uploaded below
+
+    vector<GPUTri> gpuTris = gpu_tris();
+    vector<GPUSph> gpuSphs = gpu_sphs();
+
+    vector<GPUNode> gpuNodes = gpu_nodes(nodes);
+
     vector<GPUMaterial> gpuMaterials;
     for (Material& mat : materials) {
         GPUMaterial gmat;
@@ -127,25 +309,151 @@ void init(GLuint triSSBO, GLuint sphSSBO, GLuint bvhSSBO,
         gpuMaterials.push_back(gmat);
     }
 
+    vector<Mesh> gpuMeshes = gpu_meshes();
+    vector<GPUTLAS> gpuTLAS = gpu_tlas();
+
+    float sahCost = 0.0f;
+    for (const Mesh& mesh : meshes) sahCost += computeSAH(mesh);
+
     cout << "Memory Usage:\n"
          << " - Triangle size: " << (gpuTris.size() * sizeof(GPUTri)) / 1000000.0 << " MB" << "\n"
          << " - Sphere size: " << (gpuSphs.size() * sizeof(GPUSph)) / 1000000.0 << " MB" << "\n"
+         << " - Sphere BVH size: " << (sphereNodes.size() * sizeof(GPUNode) + sphereIndices.size() * sizeof(int)) / 1000000.0 << " MB" << "\n"
          << " - BVH size: " << (gpuNodes.size() * sizeof(GPUNode)) / 1000000.0 << " MB" << "\n"
+         << " - Wide BVH size: " << (wideNodes.size() * sizeof(WideNode)) / 1000000.0 << " MB" << "\n"
+         << " - Quantized BVH size: " << (quantizedNodes.size() * sizeof(QuantizedNode)) / 1000000.0 << " MB" << "\n"
+         << " - TLAS size: " << (gpuTLAS.size() * sizeof(GPUTLAS)) / 1000000.0 << " MB"
+         << " (" << (tlas.size() * sizeof(TLAS)) / 1000000.0 << " MB unpacked)\n"
+         << " - Instance size: " << (instances.size() * sizeof(Instance)) / 1000000.0 << " MB" << "\n"
          << "Total Amounts:\n"
          << " - triangles: " << triangles.size() << "\n"
          << " - spheres: " << spheres.size() << "\n"
-         << " - BVH nodes: " << nodes.size() << "\n";
+         << " - meshes: " << meshes.size() << ", placed " << instances.size() << " times\n"
+         << " - BVH nodes: " << nodes.size() << "\n"
+         << "BVH Quality:\n"
+         << " - SAH cost (sum over meshes): " << sahCost << "\n";
 
     createAndFillSSBO<GPUTri>(triSSBO, 0, gpuTris);
     createAndFillSSBO<GPUSph>(sphSSBO, 1, gpuSphs);
     createAndFillSSBO<GPUNode>(bvhSSBO, 2, gpuNodes);
     createAndFillSSBO<GPUMaterial>(materialSSBO, 3, gpuMaterials);
-    createAndFillSSBO<int>(triIndSSBO, 4, triIndices);
-    createAndFillSSBO<Mesh>(meshSSBO, 5, meshes);
-    createAndFillSSBO<TLAS>(tlasSSBO, 6, tlas);
+    if (!bvhSettings.reorder) createAndFillSSBO<int>(triIndSSBO, 4, triIndices);
+    createAndFillSSBO<Mesh>(meshSSBO, 5, gpuMeshes);
+    createAndFillSSBO<GPUTLAS>(tlasSSBO, 6, gpuTLAS);
+    if (bvhSettings.compress) createAndFillSSBO<QuantizedNode>(wideSSBO, 7, quantizedNodes);
+    else if (traceWidth() > 2) createAndFillSSBO<WideNode>(wideSSBO, 7, wideNodes);
+    createAndFillSSBO<Instance>(instanceSSBO, 8, instances);
+    // made even without a sphere BVH, so that edits can always upload into them
+    createAndFillSSBO<GPUNode>(sphereBVHSSBO, 9, gpu_nodes(sphereNodes));
+    createAndFillSSBO<int>(sphereIndSSBO, 10, sphereIndices);
 }
 
-int main() {
+// Parses the whole of text as a number within [lo, hi].
+static bool parseNumber(const string& text, float lo, float hi, float& value) {
+    char* end = nullptr;
+    float parsed = strtof(text.c_str(), &end);
+    if (text.empty() || *end != '\0' || !(parsed >= lo && parsed <= hi)) return false;
+    value = parsed;
+    return true;
+}
+
+static bool parseNumber(const string& text, int lo, int hi, int& value) {
+    char* end = nullptr;
+    long parsed = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || parsed < lo || parsed > hi) return false;
+    value = (int)parsed;
+    return true;
+}
+
+static bool parseBuilder(const string& name, BVHBuilder& builder) {
+    const BVHBuilder all[] = { BVHBuilder::Sweep, BVHBuilder::Binned, BVHBuilder::LBVH, BVHBuilder::PLOC, BVHBuilder::SBVH };
+    for (BVHBuilder b : all) {
+        if (name == builderName(b)) {
+            builder = b;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parseLayout(const string& name, BVHLayout& layout) {
+    const BVHLayout all[] = { BVHLayout::Build, BVHLayout::DepthFirst, BVHLayout::VanEmdeBoas, BVHLayout::Treelet };
+    for (BVHLayout l : all) {
+        if (name == layoutName(l)) {
+            layout = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char** argv) {
+    bool analyze = false;
+    bool benchLayout = false;
+    bool calibrate = false;
+    bool checkEdits = false;
+    bool animate = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--analyze") {
+            analyze = true;
+        } else if (arg == "--bench-layout") {
+            benchLayout = true;
+        } else if (arg == "--calibrate") {
+            calibrate = true;
+        } else if (arg == "--check-edits") {
+            checkEdits = true;
+        } else if (arg == "--traversal-cost" && i + 1 < argc &&
+                   parseNumber(argv[i + 1], FLT_MIN, FLT_MAX, bvhSettings.traversalCost)) {
+            i++;
+        } else if (arg == "--intersection-cost" && i + 1 < argc &&
+                   parseNumber(argv[i + 1], FLT_MIN, FLT_MAX, bvhSettings.intersectionCost)) {
+            i++;
+        } else if (arg == "--max-leaf-size" && i + 1 < argc &&
+                   parseNumber(argv[i + 1], 1, Config::maxLeafCount, bvhSettings.maxLeafSize)) {
+            i++;
+        } else if (arg == "--layout" && i + 1 < argc && parseLayout(argv[i + 1], bvhSettings.layout)) {
+            i++;
+        } else if (arg == "--animate") {
+            animate = true;
+        } else if (arg == "--optimize") {
+            bvhSettings.optimize = true;
+        } else if (arg == "--presplit") {
+            bvhSettings.presplit = true;
+        } else if (arg == "--reorder") {
+            bvhSettings.reorder = true;
+        } else if (arg == "--no-cache") {
+            bvhSettings.cache = false;
+        } else if (arg == "--validate") {
+            bvhSettings.validate = true;
+        } else if (arg == "--camera-sah" && i + 1 < argc &&
+                   parseNumber(argv[i + 1], 0.0f, Config::maxCameraWeight, bvhSettings.cameraWeight)) {
+            i++;
+        } else if (arg == "--builder" && i + 1 < argc && parseBuilder(argv[i + 1], bvhSettings.builder)) {
+            i++;
+        } else {
+            cerr << "Usage: " << argv[0] << " [--analyze] [--bench-layout] [--calibrate] [--check-edits] [--animate] [--presplit] [--optimize] [--reorder] [--no-cache] [--validate]"
+                 << " [--builder sweep|binned|lbvh|ploc|sbvh] [--layout build|dfs|veb|treelet]"
+                 << " [--traversal-cost C>0] [--intersection-cost C>0] [--max-leaf-size N>=1] [--camera-sah W in 0..0.9]\n";
+            return -1;
+        }
+    }
+
+    // build the scene without a window and print BVH statistics as JSON
+    if (analyze || benchLayout || calibrate || checkEdits) {
+        streambuf* log = cout.rdbuf(cerr.rdbuf());
+        build_scene(defaultCamera(WIDTH, HEIGHT));
+        cout.rdbuf(log);
+        if (calibrate) writeCostCalibration(cout);
+        if (analyze) writeBVHAnalysis(cout);
+        if (benchLayout) writeLayoutBenchmark(cout);
+        if (checkEdits) {
+            bvhSettings.validate = true;
+            return writeEditCheck(cout) ? 0 : 1;
+        }
+        return 0;
+    }
+
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
@@ -172,8 +480,6 @@ int main() {
     glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, WIDTH, HEIGHT);
     glBindImageTexture(0, tex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
 
-    GLuint computeProgram = createProgram("../shaders/trace.glsl");
-
     float triVertices[] = { -1.0f, -1.0f,  3.0f, -1.0f, -1.0f,  3.0f };
     GLuint quadVAO, quadVBO;
     glGenVertexArrays(1, &quadVAO);
@@ -186,7 +492,8 @@ int main() {
 
     GLuint quadProgram = createQuadProgram("../shaders/quad.vert", "../shaders/quad.frag");
 
-    GLuint cameraUBO, triSSBO, sphSSBO, bvhSSBO, materialSSBO, triIndSSBO, meshSSBO, tlasSSBO, mouseUBO;
+    GLuint cameraUBO, triSSBO, sphSSBO, bvhSSBO, materialSSBO, triIndSSBO, meshSSBO, tlasSSBO, wideSSBO, instanceSSBO,
+           sphereBVHSSBO, sphereIndSSBO, mouseUBO;
     
     Camera cam;
     createCamera(cameraUBO, cam, WIDTH, HEIGHT);
@@ -196,8 +503,17 @@ int main() {
     createAndFillUBO<vec2>(mouseUBO, 2, mousePos);
 
     float initialTime = glfwGetTime();
-    init(triSSBO, sphSSBO, bvhSSBO, triIndSSBO, meshSSBO, tlasSSBO, materialSSBO);
+    init(cam, triSSBO, sphSSBO, bvhSSBO, triIndSSBO, meshSSBO, tlasSSBO, materialSSBO, wideSSBO, instanceSSBO,
+         sphereBVHSSBO, sphereIndSSBO);
     cout << "BVH build time: " << (glfwGetTime() - initialTime) << " seconds\n";
+
+    // the stack of the trace shader is sized for the trees just built
+    GLuint computeProgram = 0;
+    int stackSize = 0;
+    update_trace_program(computeProgram, stackSize);
+
+    vector<mat4> placed;
+    for (const Instance& inst : instances) placed.push_back(instanceToWorld(inst));
     
     int nbFrames = 0;
     int totalFrames = 0;
@@ -235,6 +551,25 @@ int main() {
         if (processInput(window, &cam, deltaTime)) {
             updateUBO<Camera>(cameraUBO, cam);
             totalFrames = 0;
+            // reordered triangles can't be rebuilt in place, the build camera stays put then
+            if (!bvhSettings.reorder && buildCameraMoved(cam)) {
+                rebuild_for_camera(cam, bvhSSBO, triIndSSBO, meshSSBO, wideSSBO);
+                update_trace_program(computeProgram, stackSize);
+            }
+        }
+
+        if (animate) {
+            animate_instances(placed, (float)currentTime);
+            TLASUpdate update = updateTLAS();
+            upload_tlas_update(update, tlasSSBO, instanceSSBO);
+            if (update.rebuilt) update_trace_program(computeProgram, stackSize);
+            totalFrames = 0;
+        }
+
+        if (upload_bvh_edits(triSSBO, sphSSBO, bvhSSBO, triIndSSBO, meshSSBO, tlasSSBO, wideSSBO, instanceSSBO,
+                             sphereBVHSSBO, sphereIndSSBO)) {
+            update_trace_program(computeProgram, stackSize);
+            totalFrames = 0;
         }
 
         double xpos, ypos;
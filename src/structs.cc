@@ -4,8 +4,13 @@
 std::vector<int> triIndices;
 std::vector<Tri> triangles;
 std::vector<Mesh> meshes;
+std::vector<Instance> instances;
 std::vector<Sph> spheres;
+std::vector<Node> sphereNodes;
+std::vector<int> sphereIndices;
 std::vector<Node> nodes;
+std::vector<WideNode> wideNodes;
+std::vector<QuantizedNode> quantizedNodes;
 std::vector<TLAS> tlas;
 
 std::vector<Material> getMaterials() {
@@ -7,12 +7,67 @@
 
 using namespace glm;
 
+enum class BVHBuilder {
+    Sweep,  // exhaustive SAH over every centroid, O(n^2) per node
+    Binned, // SAH evaluated at bin boundaries of the centroid bounds
+    LBVH,   // Morton-sorted linear build, optionally SAH-refined near the leaves
+    PLOC,   // bottom-up parallel locally-ordered clustering
+    SBVH    // binned SAH with spatial splits that duplicate straddling triangles
+};
+
+enum class BVHLayout {
+    Build,       // child pairs stay where the builder allocated them
+    DepthFirst,  // pre-order, so a pair is followed by its left child's pair
+    VanEmdeBoas, // recursive top half / bottom subtrees split, cache oblivious
+    Treelet      // largest-area treelets packed into layoutBlockBytes blocks
+};
+
 struct Config {
     const static int width = 600;
     const static int height = 600;
     const static int Num = 10;
-    const static int maxBVHDepth = 32;
+    const static int maxBVHDepth = 32;      // subdivide() splits deeper nodes at the object median only
     const static int minVolumeAmount = 2;
+    const static int maxLeafSize = 16;      // larger leaves are split even when SAH prefers a leaf
+    const static int maxLeafCount = 0xfffe; // quantized nodes keep leaf sizes in 16 bits, 0xffff marks an empty lane
+    constexpr static float traversalCost = 1.0f;    // SAH cost of visiting a node
+    constexpr static float intersectionCost = 1.0f; // SAH cost of testing a triangle
+    const static BVHBuilder bvhBuilder = BVHBuilder::Binned;
+    const static int sahBins = 16;
+    const static int maxSahBins = 64;
+    const static int mortonBits = 30;       // 30 or 63
+    const static int lbvhTreeletSize = 8;   // 0 keeps the pure Morton hierarchy
+    const static int plocRadius = 16;       // neighbours searched on each side in Morton order
+    const static int tlasRadius = 64;       // the same for the TLAS, instances are few so search wider
+    const static int sphereBVHMin = 32;     // more spheres than this get a BVH of their own below one TLAS leaf
+    constexpr static float sbvhBudget = 0.3f;  // extra references allowed, as a fraction of the triangles
+    constexpr static float sbvhAlpha = 1e-5f;  // child overlap, relative to the root area, that enables spatial splits
+    constexpr static float refitRebuildRatio = 1.5f;
+    const static bool presplit = false;        // splits long diagonal triangles into pieces before building
+    constexpr static float presplitBudget = 0.3f; // extra pieces allowed, as a fraction of the triangles
+    const static bool optimizeBVH = false;
+    const static int treeletSize = 7;
+    const static int maxTreeletSize = 8;
+    const static int treeletMinTris = 8;    // smallest subtree whose treelet gets restructured
+    const static int optimizePasses = 2;
+    const static int optimizeTaskDepth = 8;
+    const static int bvhWidth = 2;          // 2 traces the binary nodes, 4 or 8 collapses them into wide nodes
+    const static bool compressBVH = false;  // quantizes the wide nodes to half their size, implies a width of at least 4
+    const static bool reorderTriangles = false; // stores triangles in leaf order so the shader needs no triIndices
+    const static BVHLayout bvhLayout = BVHLayout::Build;
+    const static int layoutBlockBytes = 4096;
+    constexpr static float cameraWeight = 0.0f;           // share of primary rays in the camera-weighted SAH, 0 disables it
+    constexpr static float maxCameraWeight = 0.9f;
+    constexpr static float cameraRebuildDistance = 0.1f;  // camera travel, relative to the scene diagonal, that triggers a rebuild
+    constexpr static float cameraRebuildAngle = 20.0f;    // turn of the view direction in degrees that triggers a rebuild
+    const static bool bvhCache = true;      // stores built meshes on disk, see bvhcache.hh
+    constexpr static const char* bvhCacheDir = "bvh-cache";
+    const static bool parallelBVH = true;
+    const static int parallelTaskMin = 1024;   // smallest node whose children are built as separate tasks
+    const static int parallelSplitMin = 65536; // smallest node that bins and partitions in parallel
+    const static int parallelGrain = 16384;
+    const static int maxTraceStack = 256;      // CPU traversal stack entries, validateBVH() checks the trees fit
+    const static bool validateBVH = false;     // checks every tree after each build and edit, see validateBVH()
 };
 
 struct Tri {
@@ -61,6 +116,25 @@ struct GPUNode {
     vec4 data1; // max.x, max.y, max.z, count
 };
 
+struct GPUTLAS { // children sit at left and left + 1
+    vec4 data0; // min.x, min.y, min.z, left for inner entries, idx for leaves
+    vec4 data1; // max.x, max.y, max.z, type, -1 for inner entries
+};
+
+struct WideNode { // four child lanes stored SoA, wider nodes span consecutive blocks
+    vec4 minX, minY, minZ;
+    vec4 maxX, maxY, maxZ;
+    ivec4 child; // first block of an inner child, triIndices start of a leaf
+    ivec4 count; // 0 for inner children, triangle count for leaves, -1 for empty lanes
+};
+
+struct QuantizedNode { // a WideNode block with its lanes quantized to 8 bits inside the block bounds
+    vec4 origin;   // block min corner, w holds the biased float exponent of each axis' step in bytes 0-2
+    ivec4 child;
+    uvec4 bounds0; // lo.x, lo.y, lo.z, hi.x, one byte per lane
+    uvec4 bounds1; // hi.y, hi.z, then 16 bit counts for lanes 0-1 and 2-3 (0xffff for empty lanes)
+};
+
 struct GPUMaterial {
     vec4 data0; // color.r, color.g, color.b, reflectivity
     vec4 data1; // translucency, emission, refractiveIndex, roughness
@@ -75,11 +149,11 @@ struct Material {
     float roughness;
 };
 
-struct TLAS { // will be packed later
+struct TLAS { // uploaded as GPUTLAS, right is always left + 1
     vec4 min;
     vec4 max;
     int idx;
-    int type; // 0 = bvh, 1 = sphere
+    int type; // 0 = instance, 1 = sphere, 2 = sphere BVH root in sphereNodes
     int left;
     int right;
 };
@@ -103,16 +177,32 @@ struct Mesh {
     int triCount;
 };
 
+struct Instance { // places a mesh, whose triangles and BVH stay in object space
+    vec4 toWorld[3];  // rows of the 3x4 object to world transform
+    vec4 toObject[3]; // rows of its inverse
+    int meshIdx;
+    int pad[3];
+};
+
 static_assert(sizeof(GPUTri) == 48, "GPUTri size incorrect");
 static_assert(sizeof(Node) == 32, "Node size incorrect");
 static_assert(sizeof(GPUSph) == 16, "GPUSph size incorrect");
 static_assert(sizeof(GPUNode) == 32, "GPUNode size incorrect");
+static_assert(sizeof(GPUTLAS) == 32, "GPUTLAS size incorrect");
+static_assert(sizeof(WideNode) == 128, "WideNode size incorrect");
+static_assert(sizeof(QuantizedNode) == 64, "QuantizedNode size incorrect");
+static_assert(sizeof(Instance) == 112, "Instance size incorrect");
 
 
 extern std::vector<TLAS> tlas;
 extern std::vector<Node> nodes;
+extern std::vector<WideNode> wideNodes;
+extern std::vector<QuantizedNode> quantizedNodes;
 extern std::vector<Sph> spheres;
+extern std::vector<Node> sphereNodes;
+extern std::vector<int> sphereIndices;
 extern std::vector<Mesh> meshes;
+extern std::vector<Instance> instances;
 extern std::vector<Tri> triangles;
 extern std::vector<int> triIndices;
 extern std::vector<Material> materials;
@@ -0,0 +1,101 @@
+#include <threadpool.hh>
+
+#include <algorithm>
+
+static thread_local int workerIndex = -1;
+
+ThreadPool::ThreadPool(int threadCount) {
+    threadCount = std::max(1, threadCount);
+    for (int i = 0; i < threadCount + 1; i++) queues.push_back(std::make_unique<Queue>());
+    for (int i = 0; i < threadCount; i++) workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    sleepCv.notify_all();
+    for (std::thread& worker : workers) worker.join();
+}
+
+int ThreadPool::queueIndex() const {
+    return workerIndex >= 0 ? workerIndex : (int)workers.size();
+}
+
+void ThreadPool::submit(TaskGroup& group, std::function<void()> task) {
+    group.pending++;
+    Queue& queue = *queues[queueIndex()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back({ std::move(task), &group });
+    }
+    queued++;
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    sleepCv.notify_one();
+}
+
+bool ThreadPool::runOne(int self) {
+    Task task;
+    bool found = false;
+    int queueCount = (int)queues.size();
+    for (int k = 0; k < queueCount && !found; k++) {
+        Queue& queue = *queues[(self + k) % queueCount];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) continue;
+        if (k == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        found = true;
+    }
+    if (!found) return false;
+
+    queued--;
+    task.fn();
+    task.group->pending--;
+    return true;
+}
+
+void ThreadPool::wait(TaskGroup& group) {
+    int self = queueIndex();
+    while (group.pending.load() > 0) {
+        if (!runOne(self)) std::this_thread::yield();
+    }
+}
+
+void ThreadPool::workerLoop(int index) {
+    workerIndex = index;
+    while (true) {
+        if (runOne(index)) continue;
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepCv.wait(lock, [&] { return stopping || queued.load() > 0; });
+        if (stopping && queued.load() == 0) return;
+    }
+}
+
+ThreadPool& threadPool() {
+    static ThreadPool pool((int)std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+void parallelFor(int begin, int end, int grain, const std::function<void(int, int)>& body) {
+    grain = std::max(1, grain);
+    if (end - begin <= grain) {
+        if (end > begin) body(begin, end);
+        return;
+    }
+    ThreadPool& pool = threadPool();
+    TaskGroup group;
+    for (int lo = begin + grain; lo < end; lo += grain) {
+        int hi = std::min(end, lo + grain);
+        pool.submit(group, [&body, lo, hi] { body(lo, hi); });
+    }
+    body(begin, std::min(end, begin + grain));
+    pool.wait(group);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counts the tasks of one fork/join scope, wait() returns once it reaches zero.
+struct TaskGroup {
+    std::atomic<int> pending{0};
+};
+
+// Work-stealing pool: every worker owns a deque, pops its own work LIFO and
+// steals FIFO from the others. Threads blocked in wait() run tasks as well, so
+// tasks may freely fork and join nested work.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threadCount);
+    ~ThreadPool();
+
+    void submit(TaskGroup& group, std::function<void()> task);
+    void wait(TaskGroup& group);
+    int size() const { return (int)workers.size(); }
+
+private:
+    struct Task {
+        std::function<void()> fn;
+        TaskGroup* group;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void workerLoop(int index);
+    bool runOne(int self);
+    int queueIndex() const;
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Queue>> queues; // one per worker plus one for outside threads
+    std::atomic<int> queued{0};
+    std::mutex sleepMutex;
+    std::condition_variable sleepCv;
+    bool stopping = false;
+};
+
+ThreadPool& threadPool();
+
+// Splits [begin, end) into chunks of at most grain items and runs body(lo, hi) on the pool.
+void parallelFor(int begin, int end, int grain, const std::function<void(int, int)>& body);
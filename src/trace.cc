@@ -0,0 +1,238 @@
+#include <glm/glm.hpp>
+#include <structs.hh>
+#include <trace.hh>
+#include <bvh.hh>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+// well above what the builders make of real scenes; validateBVH() reports
+// trees that go deeper, the shader sizes its stack from maxTreeDepth()
+static const int MAX_STACK_SIZE = Config::maxTraceStack;
+static const float EPSILON = 1e-6f;
+
+CacheSim::CacheSim(int sizeBytes, int lineBytes, int ways)
+    : lineBytes(lineBytes), ways(ways), sets(std::max(1, sizeBytes / (lineBytes * ways))),
+      lines(sets * ways, UINT64_MAX) {}
+
+void CacheSim::access(uint64_t offset, int bytes) {
+    for (uint64_t line = offset / lineBytes; line <= (offset + bytes - 1) / lineBytes; line++) {
+        uint64_t* set = &lines[(line % sets) * ways];
+        int way = 0;
+        while (way < ways && set[way] != line) way++;
+        accesses++;
+        if (way == ways) {
+            misses++;
+            way = ways - 1;
+        }
+        for (; way > 0; way--) set[way] = set[way - 1];
+        set[0] = line;
+    }
+}
+
+Ray makeRay(vec3 origin, vec3 dir) {
+    Ray ray;
+    ray.origin = origin;
+    ray.dir = dir;
+    ray.invDir = vec3(1.0f) / dir;
+    return ray;
+}
+
+float intersectTriangle(const Tri& tri, const Ray& ray) {
+    vec3 e1 = tri.v1 - tri.v0;
+    vec3 e2 = tri.v2 - tri.v0;
+    vec3 h = cross(ray.dir, e2);
+    float a = dot(e1, h);
+    if (std::abs(a) < EPSILON) return FLT_MAX;
+    float f = 1.0f / a;
+    vec3 s = ray.origin - tri.v0;
+    float u = f * dot(s, h);
+    if (u < 0.0f || u > 1.0f) return FLT_MAX;
+    vec3 q = cross(s, e1);
+    float v = f * dot(ray.dir, q);
+    if (v < 0.0f || u + v > 1.0f) return FLT_MAX;
+    float t = f * dot(e2, q);
+    return t > EPSILON ? t : FLT_MAX;
+}
+
+float intersectAABB(const Ray& ray, const vec3& minBound, const vec3& maxBound) {
+    vec3 tlow = (minBound - ray.origin) * ray.invDir;
+    vec3 thigh = (maxBound - ray.origin) * ray.invDir;
+    vec3 tmin = min(tlow, thigh);
+    vec3 tmax = max(tlow, thigh);
+    float tclose = std::max(std::max(tmin.x, tmin.y), tmin.z);
+    float tfar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+    return tfar >= tclose && tfar >= 0.0f ? tclose : FLT_MAX;
+}
+
+static void intersectLeaf(int start, int count, const Ray& ray, TraceHit& hit, TraceStats* stats) {
+    for (int i = start; i < start + count; i++) {
+        float t = intersectTriangle(triangles[triIndices[i]], ray);
+        if (t < hit.t) {
+            hit.t = t;
+            hit.tri = triIndices[i];
+        }
+    }
+    if (stats) stats->triTests += count;
+}
+
+TraceHit traceBVH(int root, const Ray& ray, float maxT, TraceStats* stats) {
+    TraceHit hit = { maxT, -1 };
+    if (stats && stats->cache) stats->cache->access(uint64_t(root) * sizeof(Node), sizeof(Node));
+    int istack[MAX_STACK_SIZE];
+    float tstack[MAX_STACK_SIZE];
+    int sp = 0;
+    istack[sp] = root;
+    tstack[sp] = 0.0f;
+    sp++;
+
+    while (sp-- > 0) {
+        if (tstack[sp] >= hit.t) continue;
+        const Node& node = nodes[istack[sp]];
+        if (stats) stats->nodeVisits++;
+
+        if (node.count > 0) {
+            intersectLeaf(node.start, node.count, ray, hit, stats);
+            continue;
+        }
+
+        int left = node.start;
+        int right = left + 1;
+        float tL = intersectAABB(ray, nodes[left].min, nodes[left].max);
+        float tR = intersectAABB(ray, nodes[right].min, nodes[right].max);
+        if (stats) stats->boxTests += 2;
+        if (stats && stats->cache) stats->cache->access(uint64_t(left) * sizeof(Node), 2 * sizeof(Node));
+
+        if (tL > tR) {
+            std::swap(tL, tR);
+            std::swap(left, right);
+        }
+        if (tR < hit.t && sp < MAX_STACK_SIZE) {
+            istack[sp] = right;
+            tstack[sp] = tR;
+            sp++;
+        }
+        if (tL < hit.t && sp < MAX_STACK_SIZE) {
+            istack[sp] = left;
+            tstack[sp] = tL;
+            sp++;
+        }
+    }
+    return hit;
+}
+
+template <typename LoadBlock>
+static TraceHit traceWide(int root, int width, const Ray& ray, float maxT, TraceStats* stats, int blockBytes, LoadBlock loadBlock) {
+    TraceHit hit = { maxT, -1 };
+    int blocks = width > 4 ? 2 : 1;
+    int istack[MAX_STACK_SIZE];
+    float tstack[MAX_STACK_SIZE];
+    int sp = 0;
+    istack[sp] = root;
+    tstack[sp] = 0.0f;
+    sp++;
+
+    while (sp-- > 0) {
+        if (tstack[sp] >= hit.t) continue;
+        int idx = istack[sp];
+        if (stats) stats->nodeVisits++;
+
+        int childIdx[8];
+        float childT[8];
+        int hits = 0;
+        for (int b = 0; b < blocks; b++) {
+            const WideNode wide = loadBlock(idx + b);
+            if (stats && stats->cache) stats->cache->access(uint64_t(idx + b) * blockBytes, blockBytes);
+
+            // one slab test for all four lanes, written lane-wise so it vectorizes
+            float tclose[4];
+            float tfar[4];
+            for (int l = 0; l < 4; l++) {
+                float tx0 = (wide.minX[l] - ray.origin.x) * ray.invDir.x;
+                float tx1 = (wide.maxX[l] - ray.origin.x) * ray.invDir.x;
+                float ty0 = (wide.minY[l] - ray.origin.y) * ray.invDir.y;
+                float ty1 = (wide.maxY[l] - ray.origin.y) * ray.invDir.y;
+                float tz0 = (wide.minZ[l] - ray.origin.z) * ray.invDir.z;
+                float tz1 = (wide.maxZ[l] - ray.origin.z) * ray.invDir.z;
+                tclose[l] = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::min(tz0, tz1));
+                tfar[l] = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+            }
+            if (stats) stats->boxTests += 4;
+
+            for (int l = 0; l < 4; l++) {
+                int count = wide.count[l];
+                if (count < 0 || tfar[l] < tclose[l] || tfar[l] < 0.0f || tclose[l] >= hit.t) continue;
+                if (count > 0) {
+                    intersectLeaf(wide.child[l], count, ray, hit, stats);
+                } else {
+                    childIdx[hits] = wide.child[l];
+                    childT[hits] = tclose[l];
+                    hits++;
+                }
+            }
+        }
+
+        // push far to near so the nearest child is popped first
+        for (int i = 1; i < hits; i++) {
+            for (int j = i; j > 0 && childT[j] > childT[j - 1]; j--) {
+                std::swap(childT[j], childT[j - 1]);
+                std::swap(childIdx[j], childIdx[j - 1]);
+            }
+        }
+        for (int i = 0; i < hits && sp < MAX_STACK_SIZE; i++) {
+            istack[sp] = childIdx[i];
+            tstack[sp] = childT[i];
+            sp++;
+        }
+    }
+    return hit;
+}
+
+TraceHit traceWideBVH(int root, int width, const Ray& ray, float maxT, TraceStats* stats) {
+    return traceWide(root, width, ray, maxT, stats, sizeof(WideNode), [](int idx) { return wideNodes[idx]; });
+}
+
+TraceHit traceQuantizedBVH(int root, int width, const Ray& ray, float maxT, TraceStats* stats) {
+    return traceWide(root, width, ray, maxT, stats, sizeof(QuantizedNode), [](int idx) {
+        return decodeQuantizedNode(quantizedNodes[idx]);
+    });
+}
+
+Ray toObjectSpace(const Instance& inst, const Ray& ray) {
+    vec4 origin = vec4(ray.origin, 1.0f);
+    vec3 dir;
+    vec3 o;
+    for (int r = 0; r < 3; r++) {
+        o[r] = dot(inst.toObject[r], origin);
+        dir[r] = dot(vec3(inst.toObject[r]), ray.dir);
+    }
+    return makeRay(o, dir);
+}
+
+TraceTrees collapseTraceTrees(int width, bool compressed) {
+    TraceTrees trees;
+    trees.width = width;
+    trees.compressed = compressed && width > 2;
+    if (width > 2) wideNodes.clear();
+    for (const Mesh& mesh : meshes) {
+        trees.roots.push_back(width > 2 && mesh.bvhRoot >= 0 ? collapseBVH(mesh, width) : mesh.bvhRoot);
+    }
+    if (trees.compressed) quantizeWideBVH();
+    return trees;
+}
+
+TraceHit traceInstances(const TraceTrees& trees, const Ray& ray, float maxT, TraceStats* stats) {
+    TraceHit hit = { maxT, -1 };
+    for (const Instance& inst : instances) {
+        int root = trees.roots[inst.meshIdx];
+        if (root < 0) continue;
+        Ray local = toObjectSpace(inst, ray);
+        TraceHit h;
+        if (trees.compressed) h = traceQuantizedBVH(root, trees.width, local, hit.t, stats);
+        else if (trees.width > 2) h = traceWideBVH(root, trees.width, local, hit.t, stats);
+        else h = traceBVH(root, local, hit.t, stats);
+        if (h.tri >= 0) hit = h;
+    }
+    return hit;
+}
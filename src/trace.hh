@@ -0,0 +1,83 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <structs.hh>
+
+#include <cstdint>
+#include <vector>
+
+// CPU counterparts of the traversal loops in trace.glsl, used for tooling and
+// benchmarks rather than for rendering.
+
+struct Ray {
+    vec3 origin;
+    vec3 dir;
+    vec3 invDir;
+};
+
+struct TraceHit {
+    float t;
+    int tri; // -1 when nothing was hit
+};
+
+// Set associative LRU cache fed with byte offsets into a node buffer, to
+// compare how well node layouts keep traversal fetches in cache.
+class CacheSim {
+public:
+    CacheSim(int sizeBytes = 32768, int lineBytes = 64, int ways = 8);
+    void access(uint64_t offset, int bytes);
+
+    long accesses = 0;
+    long misses = 0;
+
+private:
+    int lineBytes;
+    int ways;
+    int sets;
+    std::vector<uint64_t> lines; // ways entries per set, most recently used first
+};
+
+struct TraceStats {
+    long nodeVisits = 0;
+    long boxTests = 0;
+    long triTests = 0;
+    CacheSim* cache = nullptr; // records every node fetch when set
+};
+
+Ray makeRay(vec3 origin, vec3 dir);
+
+float intersectTriangle(const Tri& tri, const Ray& ray);
+
+// Entry distance into the box, FLT_MAX when the ray misses it.
+float intersectAABB(const Ray& ray, const vec3& minBound, const vec3& maxBound);
+
+// Closest hit below the binary node root, nearer than maxT.
+TraceHit traceBVH(int root, const Ray& ray, float maxT, TraceStats* stats = nullptr);
+
+// Closest hit below the wide node root (see collapseBVH), nearer than maxT.
+TraceHit traceWideBVH(int root, int width, const Ray& ray, float maxT, TraceStats* stats = nullptr);
+
+// Same as traceWideBVH but walks the quantized copy of the wide nodes.
+TraceHit traceQuantizedBVH(int root, int width, const Ray& ray, float maxT, TraceStats* stats = nullptr);
+
+// ray in the object space of inst. The direction keeps the scale of the
+// transform, so distances along it are the world space distances.
+Ray toObjectSpace(const Instance& inst, const Ray& ray);
+
+// The mesh trees traceInstances() walks, width wide and read from
+// quantizedNodes when compressed. roots[m] is the root of meshes[m], -1 for
+// meshes without a BVH.
+struct TraceTrees {
+    int width = 2;
+    bool compressed = false;
+    std::vector<int> roots;
+};
+
+// The binary BVHs of meshes at a width of 2. Wider trees are collapsed anew
+// into wideNodes, which drops the ones there before, and quantized as well
+// when compressed is set.
+TraceTrees collapseTraceTrees(int width, bool compressed = false);
+
+// Closest hit over every instance, tracing each one's mesh tree in object
+// space without the TLAS.
+TraceHit traceInstances(const TraceTrees& trees, const Ray& ray, float maxT, TraceStats* stats = nullptr);
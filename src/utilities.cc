@@ -117,7 +117,6 @@ vector<Mesh> createObjectFromFile(const string& path) {
             }
             tri.materialIdx = currentMaterial;
             triangles.push_back(tri);
-            triIndices.push_back(static_cast<int>(triangles.size() - 1));
             currentCount++;
         }
     }
@@ -158,8 +157,13 @@ GLuint compileShader(GLenum type, const string& src) {
     return shader;
 }
 
-GLuint createProgram(const string& compPath) {
+GLuint createProgram(const string& compPath, const string& defines) {
     string src = loadFile(compPath);
+    if (!defines.empty()) {
+        // defines have to follow the #version line
+        size_t eol = src.find('\n', src.find("#version"));
+        src.insert(eol == string::npos ? src.size() : eol + 1, defines + "\n");
+    }
     GLuint shader = compileShader(GL_COMPUTE_SHADER, src);
     GLuint prog = glCreateProgram();
     glAttachShader(prog, shader);
@@ -226,8 +230,8 @@ void createLights() {
     createAndFillUBO<Light>(lightUBO, 1, light);
 }
 
-void createCamera(GLuint &cameraUBO, Camera &cam, int width, int height) {
-    cam = {
+Camera defaultCamera(int width, int height) {
+    return {
         vec3(0.0f, 0.0f, 20.0f),
         radians(45.0f),
         vec3(0.0f, 0.0f, -1.0f),
@@ -235,6 +239,10 @@ void createCamera(GLuint &cameraUBO, Camera &cam, int width, int height) {
         vec3(0.0f, 1.0f, 0.0f),
         0
     };
+}
+
+void createCamera(GLuint &cameraUBO, Camera &cam, int width, int height) {
+    cam = defaultCamera(width, height);
     createAndFillUBO<Camera>(cameraUBO, 0, cam);
 }
 
@@ -243,7 +251,6 @@ void add_object(std::vector<Tri>& tris, int materialIdx) {
         Tri tri = tris[i];
         if (materialIdx != -1) tri.materialIdx = materialIdx;
         triangles.push_back(tri);
-        triIndices.push_back(static_cast<int>(triangles.size() - 1));
     }
 }
 
@@ -33,10 +33,10 @@ std::string loadFile(const std::string& path);
 
 // OpenGL shader/program helpers
 GLuint compileShader(GLenum type, const std::string& src);
-GLuint createProgram(const std::string& compPath);
+GLuint createProgram(const std::string& compPath, const std::string& defines = "");
 GLuint createQuadProgram(const std::string& vertPath, const std::string& fragPath);
 template <typename T>
-GLuint createAndFillSSBO(GLuint ssbo, int binding, const std::vector<T>& data) {
+GLuint createAndFillSSBO(GLuint& ssbo, int binding, const std::vector<T>& data) {
     glGenBuffers(1, &ssbo);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
     glBufferData(GL_SHADER_STORAGE_BUFFER, static_cast<GLsizeiptr>(data.size() * sizeof(T)), data.data(), GL_DYNAMIC_DRAW);
@@ -45,6 +45,50 @@ GLuint createAndFillSSBO(GLuint ssbo, int binding, const std::vector<T>& data) {
     return ssbo;
 }
 
+// Replaces the whole contents of an SSBO made by createAndFillSSBO(), which may change its size.
+template <typename T>
+GLuint updateSSBO(GLuint& ssbo, const std::vector<T>& data) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, static_cast<GLsizeiptr>(data.size() * sizeof(T)), data.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return ssbo;
+}
+
+// Uploads only data[i] for the ascending indices, one glBufferSubData() per run
+// of consecutive ones. The SSBO must already hold data.size() elements.
+template <typename T>
+GLuint updateSSBOEntries(GLuint& ssbo, const std::vector<T>& data, const std::vector<int>& indices) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    for (size_t i = 0; i < indices.size();) {
+        size_t end = i + 1;
+        while (end < indices.size() && indices[end] == indices[end - 1] + 1) end++;
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, static_cast<GLintptr>(indices[i] * sizeof(T)),
+                        static_cast<GLsizeiptr>((end - i) * sizeof(T)), data.data() + indices[i]);
+        i = end;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return ssbo;
+}
+
+// Same for data kept in another layout on the CPU, converting src[i] with
+// convert(src[i]) run by run, so only the uploaded elements get converted.
+template <typename T, typename S, typename F>
+GLuint updateSSBOEntries(GLuint& ssbo, const std::vector<S>& src, const std::vector<int>& indices, F convert) {
+    std::vector<T> run;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    for (size_t i = 0; i < indices.size();) {
+        size_t end = i + 1;
+        while (end < indices.size() && indices[end] == indices[end - 1] + 1) end++;
+        run.clear();
+        for (size_t k = i; k < end; k++) run.push_back(convert(src[indices[k]]));
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, static_cast<GLintptr>(indices[i] * sizeof(T)),
+                        static_cast<GLsizeiptr>(run.size() * sizeof(T)), run.data());
+        i = end;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return ssbo;
+}
+
 template <typename T>
 GLuint createAndFillUBO(GLuint& ubo, int binding, const T& data) {
     glGenBuffers(1, &ubo);
@@ -68,4 +112,5 @@ bool processInput(GLFWwindow* window, Camera* cam, float deltaTime);
 
 // UBO creation
 void createLights();
+Camera defaultCamera(int width, int height);
 void createCamera(GLuint& cameraUBO, Camera& cam, int width, int height);
\ No newline at end of file